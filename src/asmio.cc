@@ -1,8 +1,14 @@
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cctype>
+#include <iterator>
+#include <numeric>
 #include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <variant>
 
 #include "asmio.h"
@@ -28,6 +34,11 @@ namespace exasm {
         }
     } // namespace
 
+    // Instructions are copied around freely while linking.
+    static_assert(std::is_trivially_copyable_v<Inst>);
+
+#include "inst_name_to_enum.inc"
+
     std::string AsmReader::format_error(std::string message) {
         std::string result = ""
                              "Parse error at line " +
@@ -38,113 +49,69 @@ namespace exasm {
         return result;
     }
 
+    AsmReader::AsmReader(std::istream &strm)
+        : owned(std::istreambuf_iterator<char>(strm), std::istreambuf_iterator<char>()),
+          src(owned) {}
+
     std::variant<InstType, PseudoInst> AsmReader::read_inst_type() {
-        std::string inst;
-        for (;;) {
-            char c;
-            strm.get(c);
-            if (strm.fail()) {
-                break;
-            }
-            if ((inst.empty() && c == '.') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9')) {
-                inst.push_back(c);
+        std::size_t begin = pos;
+        while (!at_end()) {
+            char c = src[pos];
+            if ((pos == begin && c == '.') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9')) {
+                ++pos;
             } else {
-                strm.unget();
                 break;
             }
         }
+        std::string_view inst = src.substr(begin, pos - begin);
 
-#include "inst_name_to_enum.inc"
-
-        if (inst == ".li") {
-            return PseudoInst::LI;
-        } else if (inst == ".word") {
-            return PseudoInst::WORD;
+        if (std::optional<std::variant<InstType, PseudoInst>> type = find_mnemonic(inst)) {
+            return *type;
         }
 
-        throw ParseError(format_error("Unknown instruction: " + inst));
+        throw ParseError(format_error("Unknown instruction: " + std::string(inst)));
     }
 
     void AsmReader::next_line() {
-        for (;;) {
-            char c;
-            strm.get(c);
-            if (strm.fail()) {
-                break;
-            }
-            if (c == '\n') {
-                ++linum;
-                return;
-            }
+        std::size_t newline = src.find('\n', pos);
+        if (newline == std::string_view::npos) {
+            pos = src.size();
+            return;
         }
+        pos = newline + 1;
+        ++linum;
     }
 
     void AsmReader::skip_space() {
-        bool comment = false;
-        for (;;) {
-            char c;
-            strm.get(c);
-            if (strm.fail()) {
-                return;
-            }
-            if (c == '#') {
-                comment = true;
-            }
-            if (comment) {
-                if (c == '\r' || c == '\n') {
-                    strm.unget();
-                    return;
-                }
-            } else {
-                if (!(c == ' ' || c == '\t')) {
-                    strm.unget();
-                    return;
-                }
-            }
+        while (!at_end() && (src[pos] == ' ' || src[pos] == '\t')) {
+            ++pos;
+        }
+        if (!at_end() && src[pos] == '#') {
+            pos = std::min(src.find_first_of("\r\n", pos), src.size());
         }
     }
 
     void AsmReader::must_read_newline(const std::string &context) {
-        char c;
-        strm.get(c);
-        if (strm.fail()) {
-            return;
-        }
-        if (c == '\r') {
-            strm.get(c);
-            if (strm.fail()) {
-                return;
-            }
-            if (c != '\n') {
-                ++linum;
-                strm.unget();
-                return;
-            }
-        } else if (c != '\n') {
-            strm.unget();
+        if (!skip_newline()) {
             throw ParseError(format_error("New line expected " + context));
         }
-        ++linum;
     }
 
     bool AsmReader::skip_newline() {
-        char c;
-        strm.get(c);
-        if (strm.fail()) {
+        if (at_end()) {
             return true;
         }
-        if (c == '\r') {
-            strm.get(c);
-            if (strm.fail()) {
+        if (src[pos] == '\r') {
+            ++pos;
+            if (at_end()) {
                 return true;
             }
-            if (c != '\n') {
-                ++linum;
-                strm.unget();
-                return true;
+            if (src[pos] == '\n') {
+                ++pos;
             }
-        } else if (c != '\n') {
-            strm.unget();
+        } else if (src[pos] == '\n') {
+            ++pos;
+        } else {
             return false;
         }
         ++linum;
@@ -154,12 +121,9 @@ namespace exasm {
     bool AsmReader::goto_next_instruction() {
         for (;;) {
             skip_space();
-            char c;
-            strm.get(c);
-            if (strm.fail()) {
+            if (at_end()) {
                 return false;
             }
-            strm.unget();
             if (!skip_newline()) {
                 return true;
             }
@@ -169,21 +133,19 @@ namespace exasm {
     bool AsmReader::finished() { return !goto_next_instruction(); }
 
     std::uint8_t AsmReader::read_reg(std::string kind) {
-        char c;
-        strm.get(c);
-        if (strm.fail()) {
+        if (at_end()) {
             throw ParseError(format_error("Register expected, but got EOF"));
         }
-        if (c != 'r') {
+        if (src[pos++] != 'r') {
             if (!kind.empty()) {
                 kind[0] = std::toupper(kind[0]);
             }
             throw ParseError(format_error(kind + " register name expected"));
         }
-        strm.get(c);
-        if (strm.fail()) {
+        if (at_end()) {
             throw ParseError(format_error("Register number expected, but got EOF"));
         }
+        char c = src[pos++];
         if ('0' <= c && c <= '9') {
             std::uint8_t reg_num = c - '0';
             if (reg_num >= 8) {
@@ -195,12 +157,10 @@ namespace exasm {
     }
 
     void AsmReader::must_read(char c, std::string context) {
-        char d;
-        strm.get(d);
-        if (strm.fail()) {
+        if (at_end()) {
             throw ParseError(format_error("Unexpected EOF"));
         }
-        if (d != c) {
+        if (src[pos++] != c) {
             std::string err_msg = "Expects '";
             err_msg.push_back(c);
             err_msg.push_back('\'');
@@ -211,60 +171,40 @@ namespace exasm {
     }
 
     bool AsmReader::maybe_read(char c) {
-        char d;
-        strm.get(d);
-        if (strm.fail()) {
-            return false;
-        }
-        if (c == d) {
+        if (!at_end() && src[pos] == c) {
+            ++pos;
             return true;
         }
-        strm.unget();
         return false;
     }
 
     template <typename T> T AsmReader::read_immediate(bool allow_sign) {
-        char c;
-        strm.get(c);
-        if (strm.fail()) {
+        if (at_end()) {
             throw ParseError(format_error("Unexpected EOF"));
         }
         bool minus = false;
-        if (allow_sign) {
-            if (c == '-') {
-                minus = true;
-                strm.get(c);
-                if (strm.fail()) {
-                    throw ParseError(format_error("Unexpected EOF"));
-                }
+        if (allow_sign && maybe_read('-')) {
+            minus = true;
+            if (at_end()) {
+                throw ParseError(format_error("Unexpected EOF"));
             }
         }
 
         T result = 0;
         int base = 10;
+        char c = src[pos++];
         if (c == '0') {
             base = 8;
-            char c;
-            strm.get(c);
-            if (strm.fail()) {
-                return 0;
-            }
-            if (c == 'x') {
+            if (maybe_read('x')) {
                 base = 16;
-            } else {
-                strm.unget();
             }
         } else if ('1' <= c && c <= '9') {
             result = c - '0';
         } else {
             throw ParseError(format_error("Illegal immediate"));
         }
-        for (;;) {
-            char c;
-            strm.get(c);
-            if (strm.fail()) {
-                break;
-            }
+        for (; !at_end(); ++pos) {
+            c = src[pos];
             int curnum;
             if ('0' <= c && c <= '9') {
                 curnum = c - '0';
@@ -273,7 +213,6 @@ namespace exasm {
             } else if ('A' <= c && c <= 'F') {
                 curnum = c - '7';
             } else {
-                strm.unget();
                 break;
             }
             result *= base;
@@ -287,40 +226,29 @@ namespace exasm {
         return result;
     }
 
-    std::string AsmReader::maybe_read_label() {
-        char c;
-        strm.get(c);
-        if (strm.fail()) {
+    std::string_view AsmReader::maybe_read_label() {
+        if (!maybe_read('@')) {
             return "";
         }
-        if (c != '@') {
-            strm.unget();
-            return "";
+        if (at_end()) {
+            throw ParseError(format_error("Label name expected"));
         }
-        strm.get(c);
-        if (strm.fail() || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+        char c = src[pos];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
             throw ParseError(format_error("Label name expected"));
         }
         if (c != '_' && (c < 'a' || 'z' < c) && (c < 'A' || 'Z' < c)) {
-            strm.unget();
             throw ParseError(format_error("Label name should start with a-z, A-Z or _"));
         }
-        std::string label_name;
-        label_name.push_back(c);
-
-        for (;;) {
-            strm.get(c);
-            if (strm.fail()) {
-                break;
-            }
+        std::size_t begin = pos++;
+        for (; !at_end(); ++pos) {
+            c = src[pos];
             if (c != '_' && (c < 'a' || 'z' < c) && (c < 'A' || 'Z' < c) && (c < '0' || '9' < c)) {
-                strm.unget();
                 break;
             }
-            label_name.push_back(c);
         }
 
-        return label_name;
+        return src.substr(begin, pos - begin);
     }
 
     void Inst::print_asm(std::ostream &out) const {
@@ -366,8 +294,24 @@ namespace exasm {
         return out;
     }
 
-    Inst Inst::decode(std::uint16_t inst){
+    std::ostream &operator<<(std::ostream &out, InstType type) {
+        switch (type) {
+#include "inst_name_writer.inc"
+        }
+        return out;
+    }
+
 #include "decoder.inc"
+
+    Inst Inst::decode(std::uint16_t inst) {
+        const DecodedInst &decoded = DecodedInst::decode(inst);
+        if (decoded.is_data) {
+            return new_with_data(inst);
+        }
+        if (decoded.has_imm) {
+            return new_with_reg_imm(decoded.type, decoded.rd, decoded.imm);
+        }
+        return new_with_reg_reg(decoded.type, decoded.rd, decoded.rs);
     }
 
     std::uint16_t Inst::encode() const {
@@ -379,45 +323,61 @@ namespace exasm {
         return pseudo_param;
     }
 
-    void RawAsm::append(Inst &&inst, const std::string &label_name) {
+    void RawAsm::append(Inst &&inst, std::string_view label_name) {
         if (linked) {
             throw std::logic_error("Appending to linked RawAsm is not allowed");
         }
 
         if (!label_name.empty()) {
-            add_label(label_name, current_addr);
+            add_label(get_symbol(label_name), current_addr);
         }
         insts.push_back(inst);
+        source_lines.push_back(current_line);
         current_addr += 2;
     }
 
-    void RawAsm::insert_inst_at_addr(Inst inst, std::uint16_t addr) {
-        for (auto itr = label_addr_mapping.begin(), e = label_addr_mapping.end(); itr != e; ++itr) {
-            if (itr->second >= addr) {
-                itr->second += 2;
+    void RawAsm::move_labels(const std::vector<std::size_t> &new_index) {
+        std::size_t end = new_index.size() - 1;
+        addr_symbols.clear();
+        for (std::uint32_t id = 0; id < symbol_addrs.size(); ++id) {
+            std::int32_t addr = symbol_addrs[id];
+            if (addr < 0) {
+                continue;
             }
+            // Addresses past the end move along with it.
+            std::size_t i = addr / 2;
+            std::size_t moved = i <= end ? new_index[i] : new_index[end] + (i - end);
+            std::uint16_t new_addr = static_cast<std::uint16_t>(moved * 2 + addr % 2);
+            symbol_addrs[id] = new_addr;
+            addr_symbols.emplace(new_addr, static_cast<SymbolId>(id));
         }
-        insts.insert(insts.begin() + static_cast<std::size_t>(addr) / 2, std::move(inst));
     }
 
     void RawAsm::pre_handle_pseudo_instructions() {
+        // .li takes two instructions, so a placeholder goes after each one.
+        std::vector<Inst> result;
+        std::vector<std::uint32_t> result_lines;
+        std::vector<std::size_t> new_index(insts.size() + 1);
+        result.reserve(insts.size());
+        result_lines.reserve(insts.size());
         for (std::size_t i = 0; i < insts.size(); ++i) {
-            if (!std::holds_alternative<PseudoInst>(insts[i].inst)) {
-                continue;
-            }
-            Inst inst = insts[i];
-            switch (std::get<PseudoInst>(insts[i].inst)) {
-            case PseudoInst::PLACEHOLDER:
-                break;
-            case PseudoInst::LI:
-                insert_inst_at_addr(Inst::new_with_p_reg_imm(PseudoInst::PLACEHOLDER, 0, "", 0),
-                                    static_cast<std::uint16_t>((i + 1) * 2));
-                ++i;
-                break;
-            case PseudoInst::WORD:
-                break;
+            new_index[i] = result.size();
+            bool is_li = std::holds_alternative<PseudoInst>(insts[i].inst) &&
+                         std::get<PseudoInst>(insts[i].inst) == PseudoInst::LI;
+            result.push_back(std::move(insts[i]));
+            result_lines.push_back(source_lines[i]);
+            if (is_li) {
+                result.push_back(Inst::new_with_p_reg_imm(PseudoInst::PLACEHOLDER, 0, 0));
+                result_lines.push_back(source_lines[i]);
             }
         }
+        new_index[insts.size()] = result.size();
+        bool grown = result.size() != insts.size();
+        insts = std::move(result);
+        source_lines = std::move(result_lines);
+        if (grown) {
+            move_labels(new_index);
+        }
     }
 
     void RawAsm::post_handle_pseudo_instructions() {
@@ -430,10 +390,10 @@ namespace exasm {
                 break;
             case PseudoInst::LI: {
                 std::uint16_t actual_imm;
-                if (std::get<std::string>(insts[i].imm).empty()) {
+                if (!std::holds_alternative<SymbolId>(insts[i].imm)) {
                     actual_imm = insts[i].pseudo_param;
                 } else {
-                    actual_imm = get_destination(std::get<std::string>(insts[i].imm));
+                    actual_imm = get_destination(std::get<SymbolId>(insts[i].imm));
                     actual_imm += static_cast<std::int16_t>(insts[i].pseudo_param);
                 }
                 insts[i].inst = InstType::LUI;
@@ -452,82 +412,579 @@ namespace exasm {
 
 #include "inst_traits.inc"
 
+    namespace {
+        // Where a branch goes while long jumps are relaxed: an instruction of
+        // the program or a trampoline.
+        class RelaxTarget {
+        public:
+            bool is_trampoline;
+            // Instruction index, past the end for addresses after the
+            // program, or trampoline index.
+            std::size_t index;
+            // Label of the instruction.
+            SymbolId label;
+        };
+
+        // A jump in the island placed before an instruction. An island is
+        // "j over; nop" followed by "j dest; nop" for each of its trampolines,
+        // without the "j over" where code can't run into it.
+        class Trampoline {
+        public:
+            std::size_t island;
+            std::size_t slot;
+            RelaxTarget dest;
+            // The instruction the chain of jumps ends at.
+            RelaxTarget final;
+        };
+    } // namespace
+
     void RawAsm::handle_long_jump() {
-        bool has_edit = true;
-        while (has_edit) {
-            has_edit = false;
-            for (std::size_t i = 0; i < insts.size(); ++i) {
-                if (!std::holds_alternative<InstType>(insts[i].inst)) {
-                    continue;
+        std::size_t n = insts.size();
+        auto is_branch = [this](std::size_t i) {
+            return std::holds_alternative<InstType>(insts[i].inst) &&
+                   is_inst_branch(std::get<InstType>(insts[i].inst));
+        };
+        std::vector<Trampoline> trampolines;
+        // Trampolines by the instruction they end at, for branches going the
+        // same way to share.
+        std::unordered_map<std::size_t, std::vector<std::size_t>> trampolines_to;
+        // Slots laid out for each island, and those taken in the current pass.
+        std::vector<std::size_t> island_slots(n + 1, 0);
+        std::vector<std::size_t> used_slots(n + 1, 0);
+        // Code after an unconditional jump and its delay slot only runs when
+        // jumped to, so an island there needs no jump over it.
+        std::vector<bool> needs_skip(n + 1, true);
+        for (std::size_t b = 2; b <= n; ++b) {
+            needs_skip[b] = !(std::holds_alternative<InstType>(insts[b - 2].inst) &&
+                              is_inst_jump(std::get<InstType>(insts[b - 2].inst)) &&
+                              !is_branch(b - 1));
+        }
+        auto island_head = [&](std::size_t b) { return needs_skip[b] ? 4 : 0; };
+        // As many trampolines as the jump over an island reaches past.
+        constexpr std::size_t max_island_slots = 31;
+        // A new trampoline joins an island at most this many instructions
+        // closer to its branch rather than starting another one.
+        constexpr std::size_t island_window = 16;
+
+        // An island can't split a branch from its delay slot or a .li.
+        std::vector<bool> can_place_island(n + 1, true);
+        for (std::size_t b = 1; b <= n; ++b) {
+            if (std::holds_alternative<PseudoInst>(insts[b - 1].inst)) {
+                can_place_island[b] = std::get<PseudoInst>(insts[b - 1].inst) != PseudoInst::LI;
+            } else {
+                can_place_island[b] = !is_branch(b - 1);
+            }
+        }
+
+        std::vector<std::size_t> sites;
+        std::vector<RelaxTarget> site_finals;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (is_branch(i)) {
+                SymbolId label = std::get<SymbolId>(insts[i].imm);
+                sites.push_back(i);
+                site_finals.push_back(RelaxTarget{false, get_destination(label) / 2u, label});
+            }
+        }
+        std::vector<RelaxTarget> site_targets(site_finals);
+
+        // Addresses of each instruction and of the island before it, as laid
+        // out when a pass starts.
+        std::vector<std::int32_t> inst_addr(n + 1);
+        std::vector<std::int32_t> island_addr(n + 1);
+        // A trampoline is seen at the start of its island by the code before
+        // it and at the end by the code after it, which keeps distances right
+        // when its island grows within a pass. Both are where it is once a
+        // pass needs no more slots than were laid out.
+        auto early_addr = [&](const RelaxTarget &at) {
+            if (at.is_trampoline) {
+                const Trampoline &t = trampolines[at.index];
+                return island_addr[t.island] + island_head(t.island) +
+                       4 * static_cast<std::int32_t>(t.slot);
+            } else if (at.index <= n) {
+                return inst_addr[at.index];
+            }
+            return inst_addr[n] + 2 * static_cast<std::int32_t>(at.index - n);
+        };
+        auto late_addr = [&](const RelaxTarget &at) {
+            if (at.is_trampoline) {
+                const Trampoline &t = trampolines[at.index];
+                std::size_t slots = std::max(island_slots[t.island], used_slots[t.island]);
+                return inst_addr[t.island] - 4 * static_cast<std::int32_t>(slots - t.slot);
+            }
+            return early_addr(at);
+        };
+        // Islands sit at even positions, each before the instruction at the
+        // odd position after it. Every hop gets strictly closer to where its
+        // chain ends, so chains of jumps can't loop.
+        auto position_of = [&](const RelaxTarget &at) {
+            return at.is_trampoline ? 2 * trampolines[at.index].island : 2 * at.index + 1;
+        };
+
+        bool grown = false;
+        // The next hop from site on the way to final: final itself if in
+        // reach, or else the trampoline to it in reach that gets closest, or
+        // else a new one in the furthest island in reach. The island right
+        // before a branch, and the one right after its delay slot, are always
+        // in its reach, so this fails only if one of them is full.
+        auto next_hop = [&](const RelaxTarget &site, const RelaxTarget &final) {
+            std::size_t end = position_of(final);
+            bool forward = end > position_of(site);
+            std::int32_t from = (forward ? late_addr(site) : early_addr(site)) + 2;
+            auto in_reach = [&](const RelaxTarget &at) {
+                return forward ? early_addr(at) - from <= 127 : from - late_addr(at) <= 128;
+            };
+            if (in_reach(final)) {
+                return final;
+            }
+            auto distance = [&](std::size_t position) {
+                return position > end ? position - end : end - position;
+            };
+            std::size_t site_distance = distance(position_of(site));
+            if (auto to = trampolines_to.find(final.index); to != trampolines_to.end()) {
+                std::optional<std::size_t> best;
+                for (std::size_t t : to->second) {
+                    std::size_t d = distance(2 * trampolines[t].island);
+                    if (d < site_distance &&
+                        (!best || d < distance(2 * trampolines[*best].island)) &&
+                        in_reach(RelaxTarget{true, t, {}})) {
+                        best = t;
+                    }
                 }
-                if (!is_inst_branch(std::get<InstType>(insts[i].inst))) {
-                    continue;
+                if (best) {
+                    return RelaxTarget{true, *best, {}};
                 }
-                std::string orig_label = std::get<std::string>(insts[i].imm);
-                std::uint16_t from = static_cast<std::uint16_t>(i) * 2 + 2;
-                std::uint16_t to = get_destination(orig_label);
-                int distance = static_cast<int>(to) - static_cast<int>(from);
-
-                if (distance < 0) {
-                    while (static_cast<int>(from) - static_cast<int>(to) > 128) {
-                        has_edit = true;
-                        std::uint16_t insert_addr = from - 124;
-                        if (std::holds_alternative<InstType>(insts[(insert_addr >> 1) - 1].inst) &&
-                            is_inst_branch(
-                                std::get<InstType>(insts[(insert_addr >> 1) - 1].inst))) {
-                            insert_addr += 2;
-                        }
-
-                        std::string orig_route = add_auto_label_at_addr(insert_addr);
-                        insert_inst_at_addr(Inst::new_with_type(InstType::NOP), insert_addr);
-                        insert_inst_at_addr(Inst::new_with_label(InstType::J, orig_label),
-                                            insert_addr);
-                        std::string step_label = add_auto_label_at_addr(insert_addr);
-                        insert_inst_at_addr(Inst::new_with_type(InstType::NOP), insert_addr);
-                        insert_inst_at_addr(Inst::new_with_label(InstType::J, orig_route),
-                                            insert_addr);
-
-                        insts[(from >> 1) + 3].imm = step_label;
-                        from = insert_addr + 6;
+            }
+
+            // Islands with room for a trampoline in reach between site and
+            // final, the furthest last.
+            std::vector<std::size_t> in_reach_islands;
+            std::size_t final_boundary = std::min(final.index, n);
+            if (forward) {
+                for (std::size_t b = position_of(site) / 2 + 1;
+                     b <= final_boundary && island_addr[b] - from <= 127; ++b) {
+                    if (can_place_island[b] && used_slots[b] < max_island_slots &&
+                        island_addr[b] + island_head(b) +
+                                4 * static_cast<std::int32_t>(used_slots[b]) - from <=
+                            127) {
+                        in_reach_islands.push_back(b);
                     }
-                } else if (0 <= distance) {
-                    while (static_cast<int>(to) - static_cast<int>(from) > 127) {
-                        has_edit = true;
-                        std::uint16_t insert_addr = from + 120;
-                        if (std::holds_alternative<InstType>(insts[(insert_addr >> 1) - 1].inst) &&
-                            is_inst_branch(
-                                std::get<InstType>(insts[(insert_addr >> 1) - 1].inst))) {
-                            insert_addr += 2;
-                        }
-
-                        std::string orig_route = add_auto_label_at_addr(insert_addr);
-                        insert_inst_at_addr(Inst::new_with_type(InstType::NOP), insert_addr);
-                        insert_inst_at_addr(Inst::new_with_label(InstType::J, orig_label),
-                                            insert_addr);
-                        std::string step_label = add_auto_label_at_addr(insert_addr);
-                        insert_inst_at_addr(Inst::new_with_type(InstType::NOP), insert_addr);
-                        insert_inst_at_addr(Inst::new_with_label(InstType::J, orig_route),
-                                            insert_addr);
-
-                        insts[(from >> 1) - 1].imm = step_label;
-                        from = insert_addr + 6;
+                }
+            } else {
+                for (std::size_t b = (position_of(site) - 1) / 2;
+                     b + 1 > final_boundary && from - inst_addr[b] <= 128; --b) {
+                    std::size_t slots = std::max(island_slots[b], used_slots[b] + 1);
+                    if (can_place_island[b] && used_slots[b] < max_island_slots &&
+                        from - inst_addr[b] +
+                                4 * static_cast<std::int32_t>(slots - used_slots[b]) <=
+                            128) {
+                        in_reach_islands.push_back(b);
                     }
                 }
             }
+            if (in_reach_islands.empty()) {
+                throw LinkError("Can't reach the destination of a long jump");
+            }
+            // The furthest island, a few bytes short of the full reach or past
+            // a delay slot there to leave room for the island to grow.
+            std::size_t furthest = 0;
+            for (std::size_t i = 0; i < in_reach_islands.size(); ++i) {
+                std::size_t b = in_reach_islands[i];
+                if (forward ? island_addr[b] - from <= 120 ||
+                                  (!can_place_island[b - 1] && island_addr[b - 1] - from <= 120)
+                            : inst_addr[b] - from >= -124) {
+                    furthest = i;
+                }
+            }
+            // Or one a little closer that has a slot laid out before and still
+            // free, so that passes settle on the same islands, or else one that
+            // exists already or needs no jump over it.
+            std::optional<std::size_t> spare;
+            std::optional<std::size_t> existing;
+            std::optional<std::size_t> unskipped;
+            for (std::size_t i = furthest + 1; i-- > 0;) {
+                std::size_t c = in_reach_islands[i];
+                std::size_t d = in_reach_islands[furthest];
+                if ((c > d ? c - d : d - c) > island_window) {
+                    break;
+                } else if (used_slots[c] < island_slots[c]) {
+                    spare = spare.value_or(c);
+                } else if (used_slots[c] != 0) {
+                    existing = existing.value_or(c);
+                } else if (!needs_skip[c]) {
+                    unskipped = unskipped.value_or(c);
+                }
+            }
+            std::size_t b = spare.value_or(
+                existing.value_or(unskipped.value_or(in_reach_islands[furthest])));
+            trampolines.push_back(Trampoline{b, used_slots[b]++, final, final});
+            grown = grown || used_slots[b] > island_slots[b];
+            return RelaxTarget{true, trampolines.size() - 1, {}};
+        };
+
+        // Each pass lays the program out with the slots reserved so far and
+        // routes every branch anew. A pass that needs more slots in an island
+        // than it has reserves them and runs again. The first settle_passes
+        // reserve just what the routes used, so that slots left behind by
+        // routes that moved on don't pile up. After that reservations never
+        // shrink and an island holds at most max_island_slots, so passes come
+        // to an end. The last pass needed no more than was laid out, so every
+        // jump reaches where it was routed to; the slots it left unused are
+        // dropped, which only brings code closer together.
+        //
+        // Passes then start over from the slots the routes use, as long as
+        // that makes the program smaller by at least 1 / min_restart_gain.
+        // The size drops each time, so that comes to an end too.
+        constexpr std::size_t settle_passes = 16;
+        constexpr std::size_t min_restart_gain = 64;
+        auto program_size = [&] {
+            std::size_t size = 0;
+            for (std::size_t b = 0; b <= n; ++b) {
+                if (used_slots[b] != 0) {
+                    size += island_head(b) + 4 * used_slots[b];
+                }
+            }
+            return size;
+        };
+        std::optional<std::size_t> best_size;
+        std::vector<Trampoline> best_trampolines;
+        std::vector<RelaxTarget> best_targets;
+        std::vector<std::size_t> best_slots;
+        for (std::size_t pass = 0;; ++pass) {
+            std::int32_t addr = 0;
+            for (std::size_t b = 0; b <= n; ++b) {
+                island_addr[b] = addr;
+                if (island_slots[b] != 0) {
+                    addr += island_head(b) + 4 * static_cast<std::int32_t>(island_slots[b]);
+                }
+                inst_addr[b] = addr;
+                addr += 2;
+            }
+
+            trampolines.clear();
+            trampolines_to.clear();
+            used_slots.assign(n + 1, 0);
+            grown = false;
+            for (std::size_t k = 0; k < sites.size(); ++k) {
+                std::size_t first_new = trampolines.size();
+                site_targets[k] = next_hop(RelaxTarget{false, sites[k], {}}, site_finals[k]);
+                // Each hop adds at most the trampoline it goes to next. Those
+                // are shared once the chain is done, as none is closer than
+                // the one before.
+                for (std::size_t t = first_new; t < trampolines.size(); ++t) {
+                    RelaxTarget dest = next_hop(RelaxTarget{true, t, {}}, site_finals[k]);
+                    trampolines[t].dest = dest;
+                }
+                for (std::size_t t = first_new; t < trampolines.size(); ++t) {
+                    trampolines_to[site_finals[k].index].push_back(t);
+                }
+            }
+            if (grown) {
+                for (std::size_t b = 0; b <= n; ++b) {
+                    island_slots[b] = pass < settle_passes
+                                          ? used_slots[b]
+                                          : std::max(island_slots[b], used_slots[b]);
+                }
+                continue;
+            }
+            std::size_t size = program_size();
+            if (best_size && *best_size <= size) {
+                trampolines = std::move(best_trampolines);
+                site_targets = std::move(best_targets);
+                used_slots = std::move(best_slots);
+                break;
+            }
+            bool done = used_slots == island_slots ||
+                        (best_size && *best_size - size < size / min_restart_gain);
+            best_size = size;
+            if (done) {
+                break;
+            }
+            best_trampolines = trampolines;
+            best_targets = site_targets;
+            best_slots = used_slots;
+            island_slots = used_slots;
+        }
+        if (trampolines.empty()) {
+            if (n > 0x8000) {
+                throw LinkError("Program too large after expanding long jumps");
+            }
+            return;
+        }
+
+        std::vector<std::size_t> users(trampolines.size(), 0);
+        for (const RelaxTarget &target : site_targets) {
+            for (const RelaxTarget *at = &target; at->is_trampoline;
+                 at = &trampolines[at->index].dest) {
+                ++users[at->index];
+            }
+        }
+        std::vector<std::vector<std::size_t>> islands(n + 1);
+        for (std::size_t b = 0; b <= n; ++b) {
+            islands[b].resize(used_slots[b]);
+        }
+        for (std::size_t t = 0; t < trampolines.size(); ++t) {
+            islands[trampolines[t].island][trampolines[t].slot] = t;
+        }
+        std::vector<std::size_t> new_index(n + 1);
+        std::size_t size = 0;
+        long_jumps.inserted_insts = 0;
+        long_jumps.skip_insts = 0;
+        for (std::size_t b = 0; b <= n; ++b) {
+            if (!islands[b].empty()) {
+                std::size_t island_size = (needs_skip[b] ? 2 : 0) + 2 * islands[b].size();
+                size += island_size;
+                long_jumps.inserted_insts += static_cast<std::uint32_t>(island_size);
+                long_jumps.skip_insts += needs_skip[b] ? 2 : 0;
+            }
+            new_index[b] = size++;
+        }
+        if (new_index[n] > 0x8000) {
+            throw LinkError("Program too large after expanding long jumps");
+        }
+        move_labels(new_index);
+
+        // Label what the jumps in islands go to, in address order.
+        std::vector<SymbolId> over_labels(n + 1);
+        std::vector<SymbolId> trampoline_labels(trampolines.size());
+        for (std::size_t b = 0; b <= n; ++b) {
+            if (islands[b].empty()) {
+                continue;
+            }
+            if (needs_skip[b]) {
+                over_labels[b] =
+                    add_auto_label_at_addr(static_cast<std::uint16_t>(new_index[b] * 2));
+            }
+            std::size_t index = new_index[b] - 2 * islands[b].size();
+            for (std::size_t t : islands[b]) {
+                trampoline_labels[t] =
+                    add_auto_label_at_addr(static_cast<std::uint16_t>(index * 2));
+                index += 2;
+            }
+        }
+        auto label_of = [&](const RelaxTarget &target) {
+            return target.is_trampoline ? trampoline_labels[target.index] : target.label;
+        };
+        auto final_addr = [&](std::size_t final) {
+            std::size_t index = final <= n ? new_index[final] : new_index[n] + (final - n);
+            return static_cast<std::uint16_t>(index * 2);
+        };
+        for (std::size_t k = 0; k < sites.size(); ++k) {
+            insts[sites[k]].imm = label_of(site_targets[k]);
+            if (!site_targets[k].is_trampoline) {
+                continue;
+            }
+            LongJumpReport::Site site{static_cast<std::uint16_t>(new_index[sites[k]] * 2),
+                                      final_addr(site_finals[k].index), 0, 0, 0};
+            for (const RelaxTarget *at = &site_targets[k]; at->is_trampoline;
+                 at = &trampolines[at->index].dest) {
+                ++site.hops;
+                (users[at->index] == 1 ? site.own_insts : site.shared_insts) += 2;
+            }
+            long_jumps.sites.push_back(site);
+        }
+
+        std::vector<Inst> result;
+        std::vector<std::uint32_t> result_lines;
+        result.reserve(size);
+        result_lines.reserve(size);
+        for (std::size_t b = 0; b <= n; ++b) {
+            if (!islands[b].empty()) {
+                if (needs_skip[b]) {
+                    result.push_back(Inst::new_with_label(InstType::J, over_labels[b]));
+                    result.push_back(Inst::new_with_type(InstType::NOP));
+                }
+                for (std::size_t t : islands[b]) {
+                    result.push_back(
+                        Inst::new_with_label(InstType::J, label_of(trampolines[t].dest)));
+                    result.push_back(Inst::new_with_type(InstType::NOP));
+                }
+                result_lines.resize(result.size(), 0);
+            }
+            if (b < n) {
+                result.push_back(std::move(insts[b]));
+                result_lines.push_back(source_lines[b]);
+            }
+        }
+        insts = std::move(result);
+        source_lines = std::move(result_lines);
+    }
+
+    namespace {
+        // Registers, memory and state an instruction uses, as its action in
+        // the ISA does.
+        class InstEffects {
+        public:
+            std::uint32_t reads = 0;
+            std::uint32_t writes = 0;
+            bool loads = false;
+            bool stores = false;
+            bool reads_state = false;
+            bool writes_state = false;
+
+            explicit InstEffects(InstType ty, std::uint8_t rd, std::uint8_t rs) {
+                if (inst_reads_rd(ty)) {
+                    reads |= 1u << rd;
+                }
+                if (inst_reads_rs(ty)) {
+                    reads |= 1u << rs;
+                }
+                if (inst_writes_rd(ty)) {
+                    writes |= 1u << rd;
+                }
+                loads = is_inst_load(ty);
+                stores = is_inst_store(ty);
+                reads_state = inst_reads_state(ty);
+                writes_state = inst_writes_state(ty);
+            }
+
+            InstEffects &operator|=(const InstEffects &other) {
+                reads |= other.reads;
+                writes |= other.writes;
+                loads = loads || other.loads;
+                stores = stores || other.stores;
+                reads_state = reads_state || other.reads_state;
+                writes_state = writes_state || other.writes_state;
+                return *this;
+            }
+
+            // Whether running this and other in either order does the same.
+            bool commutes_with(const InstEffects &other) const {
+                bool memory = (loads || stores) && (other.loads || other.stores);
+                return (writes & (other.reads | other.writes)) == 0 &&
+                       (other.writes & reads) == 0 && !(memory && (stores || other.stores)) &&
+                       !(writes_state && (other.reads_state || other.writes_state)) &&
+                       !(other.writes_state && reads_state);
+            }
+        };
+    } // namespace
+
+    void RawAsm::fill_delay_slots() {
+        std::size_t n = insts.size();
+        auto inst_type = [this](std::size_t i) -> std::optional<InstType> {
+            if (i >= insts.size() || !std::holds_alternative<InstType>(insts[i].inst)) {
+                return std::nullopt;
+            }
+            return std::get<InstType>(insts[i].inst);
+        };
+        auto is_branch = [&](std::size_t i) {
+            std::optional<InstType> ty = inst_type(i);
+            return ty && is_inst_branch(*ty);
+        };
+        auto is_nop = [&](std::size_t i) { return inst_type(i) == InstType::NOP; };
+        auto has_label = [this](std::size_t i) {
+            return addr_symbols.count(static_cast<std::uint16_t>(i * 2)) != 0 ||
+                   addr_symbols.count(static_cast<std::uint16_t>(i * 2 + 1)) != 0;
+        };
+        auto effects = [this](std::size_t i) {
+            return InstEffects(std::get<InstType>(insts[i].inst), insts[i].rd, insts[i].rs);
+        };
+        // Instructions that can stop the program stay where they are, so the
+        // error is seen at the same address.
+        auto can_move = [&](std::size_t i) {
+            std::optional<InstType> ty = inst_type(i);
+            return ty && !is_inst_branch(*ty) && *ty != InstType::NOP && !inst_may_throw(*ty);
+        };
+        // How far before a branch an instruction is looked for.
+        constexpr std::size_t fill_window = 8;
+
+        // An instruction before the branch moves into its slot if nothing it
+        // passes, nor the branch, depends on it. Jumps into what it passes
+        // would run it where they didn't before, so no label may be there,
+        // and an error there would be seen without it, so nothing it passes
+        // may stop the program.
+        std::vector<std::optional<std::size_t>> filled_from(n);
+        std::vector<bool> moved(n, false);
+        for (std::size_t i = 1; i + 1 < n; ++i) {
+            if (!is_branch(i) || !is_nop(i + 1) || has_label(i)) {
+                continue;
+            }
+            InstEffects passed = effects(i);
+            for (std::size_t j = i; j-- > 0;) {
+                if (!inst_type(j) || is_branch(j) || (j > 0 && is_branch(j - 1))) {
+                    break;
+                }
+                InstEffects moving = effects(j);
+                if (can_move(j) && moving.commutes_with(passed)) {
+                    filled_from[i] = j;
+                    moved[j] = true;
+                    break;
+                } else if (has_label(j) || i - j >= fill_window ||
+                           inst_may_throw(*inst_type(j))) {
+                    break;
+                }
+                passed |= moving;
+            }
+        }
+
+        std::vector<Inst> result;
+        std::vector<std::uint32_t> result_lines;
+        result.reserve(n);
+        result_lines.reserve(n);
+        // Labels of a moved instruction and of a dropped nop go to what
+        // follows them.
+        std::vector<std::size_t> new_index(n + 1);
+        std::vector<bool> follows(n, false);
+        for (std::size_t i = 0; i < n; ++i) {
+            new_index[i] = result.size();
+            if (moved[i]) {
+                follows[i] = true;
+            } else if (i > 0 && filled_from[i - 1]) {
+                std::size_t j = *filled_from[i - 1];
+                follows[i] = true;
+                result.push_back(insts[j]);
+                result_lines.push_back(source_lines[j]);
+            } else {
+                result.push_back(insts[i]);
+                result_lines.push_back(source_lines[i]);
+            }
+        }
+        new_index[n] = result.size();
+        for (std::size_t i = n; i-- > 0;) {
+            if (follows[i]) {
+                new_index[i] = new_index[i + 1];
+            }
+        }
+        bool shrunk = result.size() != n;
+        insts = std::move(result);
+        source_lines = std::move(result_lines);
+        if (shrunk) {
+            move_labels(new_index);
+        }
+
+        // A jump left with a nop runs a copy of the instruction it goes to
+        // instead, and goes past it. Jumps into the slot would run the copy
+        // too, so no label may be there.
+        n = insts.size();
+        for (std::size_t i = 0; i + 1 < n; ++i) {
+            std::optional<InstType> ty = inst_type(i);
+            if (!ty || !is_inst_jump(*ty) || !is_nop(i + 1) || has_label(i + 1)) {
+                continue;
+            }
+            std::uint16_t dest = get_destination(std::get<SymbolId>(insts[i].imm));
+            std::size_t t = dest / 2;
+            if (dest % 2 != 0 || !can_move(t)) {
+                continue;
+            }
+            insts[i + 1] = insts[t];
+            source_lines[i + 1] = source_lines[t];
+            insts[i].imm = add_auto_label_at_addr(static_cast<std::uint16_t>(dest + 2));
         }
     }
 
     std::vector<Inst> RawAsm::get_executable() {
         if (!linked) {
             pre_handle_pseudo_instructions();
+            if (delay_slot_filling) {
+                fill_delay_slots();
+            }
             handle_long_jump();
             post_handle_pseudo_instructions();
 
             std::uint16_t inst_pc = 0;
             for (Inst &inst : insts) {
                 inst_pc += 2;
-                if (std::holds_alternative<std::string>(inst.imm)) {
-                    std::uint16_t dest = get_destination(std::get<std::string>(inst.imm));
+                if (std::holds_alternative<SymbolId>(inst.imm)) {
+                    std::uint16_t dest = get_destination(std::get<SymbolId>(inst.imm));
                     std::uint8_t addr_diff = static_cast<std::uint8_t>(
                         static_cast<std::int16_t>(dest) - static_cast<std::int16_t>(inst_pc));
                     inst.imm = addr_diff;
@@ -537,48 +994,156 @@ namespace exasm {
             if (!insts.empty()) {
                 if (std::holds_alternative<InstType>(insts.back().inst) &&
                     is_inst_branch(std::get<InstType>(insts.back().inst))) {
-                    insert_inst_at_addr(Inst::new_with_type(InstType::NOP),
-                                        static_cast<std::uint16_t>(insts.size() << 1));
+                    std::vector<std::size_t> new_index(insts.size() + 1);
+                    std::iota(new_index.begin(), new_index.end(), 0);
+                    ++new_index.back();
+                    insts.push_back(Inst::new_with_type(InstType::NOP));
+                    source_lines.push_back(0);
+                    move_labels(new_index);
                 }
             }
 
-            label_addr_mapping.clear();
+            make_debug_info();
+            symbol_addrs.clear();
+            addr_symbols.clear();
+            source_lines.clear();
             linked = true;
         }
         return insts;
     }
 
-    std::string RawAsm::add_auto_label(std::int8_t diff_from_pc) {
+    void RawAsm::make_debug_info() {
+        for (std::uint32_t id = 0; id < symbol_addrs.size(); ++id) {
+            if (symbol_addrs[id] >= 0) {
+                debug_info.symbols.push_back(
+                    DebugInfo::Symbol{static_cast<std::uint16_t>(symbol_addrs[id]),
+                                      symbols.get_name(static_cast<SymbolId>(id))});
+            }
+        }
+        // Where labels share an address, the ones from the source come first.
+        std::sort(debug_info.symbols.begin(), debug_info.symbols.end(),
+                  [](const DebugInfo::Symbol &a, const DebugInfo::Symbol &b) {
+                      bool a_auto = a.name[0] == '!';
+                      bool b_auto = b.name[0] == '!';
+                      if (a.addr != b.addr) {
+                          return a.addr < b.addr;
+                      } else if (a_auto != b_auto) {
+                          return b_auto;
+                      }
+                      return a.name < b.name;
+                  });
+
+        for (std::size_t i = 0; i < source_lines.size(); ++i) {
+            if (i == 0 || source_lines[i] != source_lines[i - 1]) {
+                debug_info.lines.emplace_back(static_cast<std::uint16_t>(i * 2), source_lines[i]);
+            }
+        }
+        debug_info.lines.emplace_back(static_cast<std::uint16_t>(source_lines.size() * 2), 0);
+    }
+
+    const DebugInfo::Symbol *DebugInfo::find_symbol(std::uint16_t addr) const {
+        auto pos = std::upper_bound(
+            symbols.begin(), symbols.end(), addr,
+            [](std::uint16_t addr, const Symbol &symbol) { return addr < symbol.addr; });
+        if (pos == symbols.begin()) {
+            return nullptr;
+        }
+        --pos;
+        // Go back to the first symbol at that address.
+        while (pos != symbols.begin() && (pos - 1)->addr == pos->addr) {
+            --pos;
+        }
+        return &*pos;
+    }
+
+    std::uint32_t DebugInfo::find_line(std::uint16_t addr) const {
+        auto pos = std::upper_bound(lines.begin(), lines.end(), addr,
+                                    [](std::uint16_t addr, const auto &run) {
+                                        return addr < run.first;
+                                    });
+        if (pos == lines.begin()) {
+            return 0;
+        }
+        return std::prev(pos)->second;
+    }
+
+    std::ostream &DebugInfo::write_symbol(std::ostream &out, std::uint16_t addr) const {
+        const Symbol *symbol = find_symbol(addr);
+        if (symbol == nullptr) {
+            return out;
+        }
+        out << '@' << symbol->name;
+        if (addr != symbol->addr) {
+            out << "+0x" << std::hex << addr - symbol->addr << std::dec;
+        }
+        return out;
+    }
+
+    SymbolId RawAsm::add_auto_label(std::int8_t diff_from_pc) {
         std::uint16_t addr = current_addr + 2 + diff_from_pc;
         return add_auto_label_at_addr(addr);
     }
 
-    std::string RawAsm::add_auto_label_at_addr(std::uint16_t addr) {
-        for (auto const &[label, label_addr] : label_addr_mapping) {
-            if (addr == label_addr) {
-                return label;
-            }
+    SymbolId RawAsm::add_auto_label_at_addr(std::uint16_t addr) {
+        auto pos = addr_symbols.find(addr);
+        if (pos != addr_symbols.end()) {
+            return pos->second;
         }
-        std::string label("!");
-        label += std::to_string(next_auto_label);
-        ++next_auto_label;
+        SymbolId label = symbols.make_auto();
+        symbol_addrs.push_back(-1);
         add_label(label, addr);
         return label;
     }
 
-    std::uint16_t RawAsm::get_destination(const std::string &label_name) {
-        auto pos = label_addr_mapping.find(label_name);
-        if (pos == label_addr_mapping.end()) {
-            throw LinkError("Undefined label: " + label_name);
+    SymbolId RawAsm::get_symbol(std::string_view name) {
+        SymbolId id = symbols.intern(name);
+        if (symbol_addrs.size() < symbols.size()) {
+            symbol_addrs.push_back(-1);
+        }
+        return id;
+    }
+
+    std::uint16_t RawAsm::get_destination(SymbolId label) {
+        std::int32_t addr = symbol_addrs[static_cast<std::uint32_t>(label)];
+        if (addr < 0) {
+            throw LinkError("Undefined label: " + symbols.get_name(label));
+        }
+        return static_cast<std::uint16_t>(addr);
+    }
+
+    void RawAsm::add_label(SymbolId label, std::uint16_t addr) {
+        std::int32_t &label_addr = symbol_addrs[static_cast<std::uint32_t>(label)];
+        if (label_addr >= 0) {
+            throw LinkError("Duplicate label: " + symbols.get_name(label));
+        }
+        label_addr = addr;
+        addr_symbols.emplace(addr, label);
+    }
+
+    SymbolId SymbolTable::intern(std::string_view name) {
+        auto pos = ids.find(name);
+        if (pos != ids.end()) {
+            return pos->second;
         }
-        return pos->second;
+        SymbolId id = static_cast<SymbolId>(auto_numbers.size());
+        names.emplace_back(name);
+        auto_numbers.push_back(-1);
+        ids.emplace(names.back(), id);
+        return id;
+    }
+
+    SymbolId SymbolTable::make_auto() {
+        SymbolId id = static_cast<SymbolId>(auto_numbers.size());
+        names.emplace_back();
+        auto_numbers.push_back(next_auto++);
+        return id;
     }
 
-    void RawAsm::add_label(const std::string &label_name, std::uint16_t addr) {
-        if (label_addr_mapping.find(label_name) != label_addr_mapping.end()) {
-            throw LinkError("Duplicate label: " + label_name);
+    std::string SymbolTable::get_name(SymbolId id) const {
+        if (is_auto(id)) {
+            return "!" + std::to_string(auto_numbers[static_cast<std::uint32_t>(id)]);
         }
-        label_addr_mapping[label_name] = addr;
+        return names[static_cast<std::uint32_t>(id)];
     }
 
     void AsmReader::read_next(RawAsm &to) {
@@ -586,7 +1151,8 @@ namespace exasm {
             throw ParseError("AsmReader::read_next called after last instruction finished.");
         }
 
-        std::string label = maybe_read_label();
+        to.set_source_line(static_cast<std::uint32_t>(linum));
+        std::string_view label = maybe_read_label();
         skip_space();
 
         std::variant<InstType, PseudoInst> types = read_inst_type();
@@ -606,11 +1172,11 @@ namespace exasm {
                 skip_space();
                 must_read(',', "after operand");
                 skip_space();
-                std::string imm_label = maybe_read_label();
+                std::string_view imm_label = maybe_read_label();
                 if (imm_label.empty()) {
                     // 16-bit immediate
                     std::uint16_t imm = read_immediate<std::uint16_t>(true);
-                    to.append(Inst::new_with_p_reg_imm(ty, rd, imm_label, imm), label);
+                    to.append(Inst::new_with_p_reg_imm(ty, rd, imm), label);
                 } else {
                     // @foo+0xde
                     std::uint16_t addition = 0;
@@ -620,7 +1186,8 @@ namespace exasm {
                         addition = read_immediate<std::uint16_t>(false);
                         addition = ~addition + 1;
                     }
-                    to.append(Inst::new_with_p_reg_imm(ty, rd, imm_label, addition), label);
+                    SymbolId imm_symbol = to.get_symbol(imm_label);
+                    to.append(Inst::new_with_p_reg_label(ty, rd, imm_symbol, addition), label);
                 }
                 skip_space();
                 must_read_newline("after pseudo operand");
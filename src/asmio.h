@@ -1,10 +1,15 @@
 #ifndef ASMIO_H
 #define ASMIO_H
 
+#include <array>
+#include <cstdint>
+#include <deque>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -17,12 +22,54 @@ namespace exasm {
         WORD,
     };
 
+    class DecodedInst {
+    public:
+        InstType type;
+        std::uint8_t rd;
+        std::uint8_t rs;
+        std::uint8_t imm;
+        bool is_data;
+        bool has_imm;
+
+        static const DecodedInst &decode(std::uint16_t inst);
+    };
+
+    // DecodedInst of every encoding, generated from the ISA definition.
+    extern const std::array<DecodedInst, 0x10000> decode_table;
+
+    inline const DecodedInst &DecodedInst::decode(std::uint16_t inst) { return decode_table[inst]; }
+
+    // A label interned in a SymbolTable.
+    enum class SymbolId : std::uint32_t {};
+
+    // Names of labels, each stored once. Labels made by the assembler are
+    // numbered instead and named !N only when asked.
+    class SymbolTable {
+    public:
+        SymbolId intern(std::string_view name);
+        SymbolId make_auto();
+
+        std::string get_name(SymbolId id) const;
+        bool is_auto(SymbolId id) const {
+            return auto_numbers[static_cast<std::uint32_t>(id)] >= 0;
+        }
+        std::size_t size() const { return auto_numbers.size(); }
+
+    private:
+        // Names don't move once added, so ids can be keyed by views of them.
+        std::deque<std::string> names;
+        // Number of each automatic label, -1 for the named ones.
+        std::vector<std::int32_t> auto_numbers;
+        std::unordered_map<std::string_view, SymbolId> ids;
+        std::int32_t next_auto = 0;
+    };
+
     class Inst {
     public:
         std::variant<InstType, PseudoInst> inst;
         std::uint8_t rd;
         std::uint8_t rs;
-        std::variant<std::uint8_t, std::string> imm;
+        std::variant<std::uint8_t, SymbolId> imm;
         std::uint16_t pseudo_param;
 
         static Inst new_with_type(InstType inst) {
@@ -50,31 +97,42 @@ namespace exasm {
             return result;
         }
 
-        static Inst new_with_reg_label(InstType inst, std::uint8_t rd, std::string label_name) {
+        static Inst new_with_reg_label(InstType inst, std::uint8_t rd, SymbolId label) {
             Inst result;
             result.inst = inst;
             result.rd = rd;
             result.rs = 0;
-            result.imm = label_name;
+            result.imm = label;
             return result;
         }
 
-        static Inst new_with_label(InstType inst, std::string label_name) {
+        static Inst new_with_label(InstType inst, SymbolId label) {
             Inst result;
             result.inst = inst;
             result.rd = 0;
             result.rs = 0;
-            result.imm = label_name;
+            result.imm = label;
             return result;
         }
 
-        static Inst new_with_p_reg_imm(PseudoInst inst, std::uint8_t rd, std::string label_name,
+        static Inst new_with_p_reg_imm(PseudoInst inst, std::uint8_t rd,
                                        std::uint16_t pseudo_param) {
             Inst result;
             result.inst = inst;
             result.rd = rd;
             result.rs = 0;
-            result.imm = label_name;
+            result.pseudo_param = pseudo_param;
+            return result;
+        }
+
+        // pseudo_param is added to the address of label.
+        static Inst new_with_p_reg_label(PseudoInst inst, std::uint8_t rd, SymbolId label,
+                                         std::uint16_t pseudo_param) {
+            Inst result;
+            result.inst = inst;
+            result.rd = rd;
+            result.rs = 0;
+            result.imm = label;
             result.pseudo_param = pseudo_param;
             return result;
         }
@@ -104,33 +162,119 @@ namespace exasm {
         LinkError(std::string msg) : std::runtime_error(msg) {}
     };
 
+    // Symbols and source lines of a linked program, sorted by address.
+    class DebugInfo {
+    public:
+        class Symbol {
+        public:
+            std::uint16_t addr;
+            // Without the '@'. Labels added for long jumps start with '!'.
+            std::string name;
+        };
+
+        const std::vector<Symbol> &get_symbols() const { return symbols; }
+
+        // The symbol at addr or the closest one before it, nullptr if none.
+        const Symbol *find_symbol(std::uint16_t addr) const;
+
+        // Source line of the instruction at addr, 0 if the assembler made it
+        // or addr is past the program.
+        std::uint32_t find_line(std::uint16_t addr) const;
+
+        // Writes @name or @name+offset, or nothing if no symbol precedes addr.
+        std::ostream &write_symbol(std::ostream &out, std::uint16_t addr) const;
+
+    private:
+        friend class RawAsm;
+
+        std::vector<Symbol> symbols;
+        // Address of the first instruction of each run from the same line.
+        std::vector<std::pair<std::uint16_t, std::uint32_t>> lines;
+    };
+
+    // Branches routed through trampolines to reach their destinations, and
+    // what that costs.
+    class LongJumpReport {
+    public:
+        class Site {
+        public:
+            std::uint16_t addr;
+            std::uint16_t dest;
+            // Trampolines on the way. Each runs a jump and its delay slot,
+            // two cycles.
+            std::uint32_t hops;
+            // Instructions of the trampolines only this branch goes through,
+            // and of those it shares with other branches.
+            std::uint32_t own_insts;
+            std::uint32_t shared_insts;
+        };
+
+        std::vector<Site> sites;
+        // All instructions added, including the jumps over islands that code
+        // runs into, which cost two cycles each time.
+        std::uint32_t inserted_insts = 0;
+        std::uint32_t skip_insts = 0;
+    };
+
     class RawAsm {
         std::vector<Inst> insts;
+        // Source line of each instruction in insts, 0 if made by the assembler.
+        std::vector<std::uint32_t> source_lines;
+        std::uint32_t current_line = 0;
         bool linked = false;
+        bool delay_slot_filling = false;
         std::uint16_t current_addr = 0;
-        std::unordered_map<std::string, std::uint16_t> label_addr_mapping;
-        int next_auto_label = 0;
+        SymbolTable symbols;
+        // Address of each symbol, -1 until it is defined.
+        std::vector<std::int32_t> symbol_addrs;
+        // The first label added at each address.
+        std::unordered_map<std::uint16_t, SymbolId> addr_symbols;
+        DebugInfo debug_info;
+        LongJumpReport long_jumps;
 
-        std::uint16_t get_destination(const std::string &label_name);
-        void add_label(const std::string &label_name, std::uint16_t addr);
+        std::uint16_t get_destination(SymbolId label);
+        void add_label(SymbolId label, std::uint16_t addr);
         void pre_handle_pseudo_instructions();
         void post_handle_pseudo_instructions();
         void handle_long_jump();
-        void insert_inst_at_addr(Inst inst, std::uint16_t addr);
+        // Moves independent instructions into the delay slots of branches,
+        // in place of nops.
+        void fill_delay_slots();
+        // Moves the labels of each instruction i to new_index[i], which has
+        // an entry for the end of the program too.
+        void move_labels(const std::vector<std::size_t> &new_index);
+        void make_debug_info();
 
     public:
-        void append(Inst &&inst, const std::string &label_name);
+        // Instructions appended from now on come from line.
+        void set_source_line(std::uint32_t line) { current_line = line; }
+        // Fill delay slots when linking. Off by default: code moves, so a
+        // program can't rely on where its instructions are beyond labels.
+        void set_fill_delay_slots(bool enable) { delay_slot_filling = enable; }
+        void append(Inst &&inst, std::string_view label_name);
         std::vector<Inst> get_executable();
-        std::string add_auto_label(std::int8_t addr_diff);
-        std::string add_auto_label_at_addr(std::uint16_t addr);
+        // Filled in by get_executable.
+        const DebugInfo &get_debug_info() const { return debug_info; }
+        const LongJumpReport &get_long_jumps() const { return long_jumps; }
+        // The symbol named name, added if there is none yet.
+        SymbolId get_symbol(std::string_view name);
+        SymbolId add_auto_label(std::int8_t addr_diff);
+        SymbolId add_auto_label_at_addr(std::uint16_t addr);
     };
 
+    // Reads a source held in one contiguous buffer. Tokens are lexed in
+    // place; only new label names are copied out of it.
     class AsmReader {
         long linum = 1;
-        std::istream &strm;
+        // Holds the source when it was read from a stream.
+        std::string owned;
+        std::string_view src;
+        std::size_t pos = 0;
 
         std::string format_error(std::string message = "");
 
+        bool at_end() const { return pos >= src.size(); }
+
         std::variant<InstType, PseudoInst> read_inst_type();
         void next_line();
         void skip_space();
@@ -141,10 +285,13 @@ namespace exasm {
         bool maybe_read(char c);
         void must_read(char c, std::string context);
         template <typename T> T read_immediate(bool allow_sign);
-        std::string maybe_read_label();
+        std::string_view maybe_read_label();
 
     public:
-        AsmReader(std::istream &strm) : strm(strm) {}
+        // Reads the rest of strm into a buffer first.
+        AsmReader(std::istream &strm);
+        // source must outlive the reader.
+        explicit AsmReader(std::string_view source) : src(source) {}
 
         void read_next(RawAsm &to);
         void try_recover();
@@ -153,6 +300,7 @@ namespace exasm {
     };
 
     std::ostream &write_addr(std::ostream &out, std::uint16_t num);
+    std::ostream &operator<<(std::ostream &out, InstType type);
 } // namespace exasm
 
 #endif
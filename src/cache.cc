@@ -0,0 +1,97 @@
+#include <cstdint>
+#include <stdexcept>
+
+#include "cache.h"
+
+namespace exasm {
+    namespace {
+        bool is_power_of_two(std::size_t n) { return n != 0 && (n & (n - 1)) == 0; }
+    } // namespace
+
+    CacheModel::CacheModel(const CacheConfig &config) : config(config) {
+        if (!is_power_of_two(config.size) || !is_power_of_two(config.line_size) ||
+            config.associativity == 0 || config.size > 0x10000 ||
+            config.size % (config.line_size * config.associativity) != 0) {
+            throw std::invalid_argument("Unsupported cache geometry");
+        }
+        n_sets = config.size / (config.line_size * config.associativity);
+        line_bits = 0;
+        while ((std::size_t{1} << line_bits) < config.line_size) {
+            ++line_bits;
+        }
+        lines.resize(n_sets * config.associativity);
+
+        pc_hits.assign(0x10000, 0);
+        pc_misses.assign(0x10000, 0);
+        region_hits.assign(n_regions, 0);
+        region_misses.assign(n_regions, 0);
+    }
+
+    CacheModel::Line &CacheModel::choose_victim(Line *set) {
+        for (std::size_t way = 0; way < config.associativity; ++way) {
+            if (!set[way].valid) {
+                return set[way];
+            }
+        }
+        if (config.replacement == ReplacementPolicy::RANDOM) {
+            return set[random() % config.associativity];
+        }
+        Line *victim = set;
+        for (std::size_t way = 1; way < config.associativity; ++way) {
+            if (set[way].stamp < victim->stamp) {
+                victim = &set[way];
+            }
+        }
+        return *victim;
+    }
+
+    void CacheModel::access(std::uint64_t clock, std::uint16_t pc, std::uint16_t addr,
+                            bool write) {
+        std::uint16_t line_addr = addr >> line_bits;
+        if (has_last && clock == last_clock && line_addr == last_line && write == last_write) {
+            return;
+        }
+        has_last = true;
+        last_clock = clock;
+        last_line = line_addr;
+        last_write = write;
+
+        ++now;
+        Line *set = &lines[(line_addr % n_sets) * config.associativity];
+        std::uint16_t tag = static_cast<std::uint16_t>(line_addr / n_sets);
+        for (std::size_t way = 0; way < config.associativity; ++way) {
+            Line &line = set[way];
+            if (line.valid && line.tag == tag) {
+                ++hits;
+                ++pc_hits[pc];
+                ++region_hits[addr >> region_bits];
+                if (config.replacement == ReplacementPolicy::LRU) {
+                    line.stamp = now;
+                }
+                if (write && config.write_policy == WritePolicy::WRITE_BACK) {
+                    line.dirty = true;
+                }
+                return;
+            }
+        }
+
+        ++misses;
+        ++pc_misses[pc];
+        ++region_misses[addr >> region_bits];
+        if (write && !config.write_allocate) {
+            // Goes to memory through the write buffer.
+            return;
+        }
+
+        Line &victim = choose_victim(set);
+        if (victim.valid && victim.dirty) {
+            ++writebacks;
+            pending_stall += config.miss_penalty;
+        }
+        pending_stall += config.miss_penalty;
+        victim.valid = true;
+        victim.dirty = write && config.write_policy == WritePolicy::WRITE_BACK;
+        victim.tag = tag;
+        victim.stamp = now;
+    }
+} // namespace exasm
@@ -0,0 +1,109 @@
+#ifndef CACHE_HH
+#define CACHE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace exasm {
+    enum class ReplacementPolicy {
+        LRU,
+        FIFO,
+        RANDOM,
+    };
+
+    enum class WritePolicy {
+        // Writes stay in the cache until the line is evicted.
+        WRITE_BACK,
+        // Writes also go to memory through a write buffer, at no cost.
+        WRITE_THROUGH,
+    };
+
+    class CacheConfig {
+    public:
+        // In bytes. Both have to be powers of two.
+        std::size_t size = 1024;
+        std::size_t line_size = 16;
+        std::size_t associativity = 2;
+        ReplacementPolicy replacement = ReplacementPolicy::LRU;
+        WritePolicy write_policy = WritePolicy::WRITE_BACK;
+        // Whether a write miss brings the line in.
+        bool write_allocate = true;
+        // Cycles the memory stage stalls to fill a line or to write back a
+        // dirty one.
+        unsigned miss_penalty = 10;
+    };
+
+    // Hits and misses of the data accesses made by load and store
+    // instructions on a CacheConfig. What is stored is not simulated, only
+    // which lines are cached.
+    class CacheModel {
+    public:
+        // Statistics per 256-byte region of the address space.
+        static constexpr std::size_t region_bits = 8;
+        static constexpr std::size_t n_regions = 0x10000 >> region_bits;
+
+        // Throws std::invalid_argument if the geometry does not fit together.
+        explicit CacheModel(const CacheConfig &config);
+
+        const CacheConfig &get_config() const { return config; }
+
+        // The instruction at pc accesses addr in the given cycle. Accesses
+        // to one line in one cycle count once, so a word is one access.
+        void access(std::uint64_t clock, std::uint16_t pc, std::uint16_t addr, bool write);
+
+        // Returns the stall cycles caused since the last call.
+        unsigned take_stall_cycles() {
+            unsigned cycles = pending_stall;
+            pending_stall = 0;
+            return cycles;
+        }
+
+        std::uint64_t get_hit_count() const { return hits; }
+        std::uint64_t get_miss_count() const { return misses; }
+        std::uint64_t get_writeback_count() const { return writebacks; }
+
+        // Indexed by the address of the accessing instruction.
+        const std::vector<std::uint64_t> &get_pc_hits() const { return pc_hits; }
+        const std::vector<std::uint64_t> &get_pc_misses() const { return pc_misses; }
+
+        // Indexed by the accessed address >> region_bits.
+        const std::vector<std::uint64_t> &get_region_hits() const { return region_hits; }
+        const std::vector<std::uint64_t> &get_region_misses() const { return region_misses; }
+
+    private:
+        struct Line {
+            bool valid = false;
+            bool dirty = false;
+            std::uint16_t tag = 0;
+            // Last use for LRU, fill for FIFO.
+            std::uint64_t stamp = 0;
+        };
+
+        CacheConfig config;
+        std::size_t n_sets;
+        std::size_t line_bits;
+        std::vector<Line> lines;
+        std::uint64_t now = 0;
+        std::minstd_rand random;
+
+        bool has_last = false;
+        std::uint64_t last_clock = 0;
+        std::uint16_t last_line = 0;
+        bool last_write = false;
+
+        unsigned pending_stall = 0;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t writebacks = 0;
+        std::vector<std::uint64_t> pc_hits;
+        std::vector<std::uint64_t> pc_misses;
+        std::vector<std::uint64_t> region_hits;
+        std::vector<std::uint64_t> region_misses;
+
+        Line &choose_victim(Line *set);
+    };
+} // namespace exasm
+
+#endif
@@ -0,0 +1,425 @@
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "asmio.h"
+#include "cfg.h"
+#include "insts.h"
+#include "pipeline.h"
+
+namespace exasm {
+#include "inst_traits.inc"
+
+    namespace {
+        using WeightedEdges = std::vector<std::map<std::size_t, std::uint64_t>>;
+
+        std::int16_t sign_extend(std::uint8_t num) {
+            return static_cast<std::int16_t>(static_cast<std::int8_t>(num));
+        }
+
+        std::string format_addr(std::uint16_t addr) {
+            std::ostringstream strm;
+            write_addr(strm, addr);
+            return strm.str();
+        }
+
+        void add_edge(WeightedEdges &out, std::size_t from, std::size_t to, std::uint64_t weight) {
+            auto [pos, inserted] = out[from].emplace(to, weight);
+            if (!inserted) {
+                pos->second = std::max(pos->second, weight);
+            }
+        }
+
+        // Nodes reachable from root through nodes for which allowed holds, in
+        // topological order. Edges back to root are left out.
+        std::vector<std::size_t>
+        topological_order(const WeightedEdges &out, std::size_t root,
+                          const std::function<bool(std::size_t)> &allowed) {
+            enum { UNVISITED, ACTIVE, DONE };
+            std::vector<int> state(out.size(), UNVISITED);
+            std::vector<std::size_t> postorder;
+            std::vector<std::pair<std::size_t, std::map<std::size_t, std::uint64_t>::const_iterator>>
+                stack;
+            state[root] = ACTIVE;
+            stack.emplace_back(root, out[root].begin());
+            while (!stack.empty()) {
+                auto &[node, it] = stack.back();
+                if (it == out[node].end()) {
+                    state[node] = DONE;
+                    postorder.push_back(node);
+                    stack.pop_back();
+                    continue;
+                }
+                std::size_t next = (it++)->first;
+                if (next == root || !allowed(next) || state[next] == DONE) {
+                    continue;
+                }
+                if (state[next] == ACTIVE) {
+                    throw AnalysisError("Irreducible control flow");
+                }
+                state[next] = ACTIVE;
+                stack.emplace_back(next, out[next].begin());
+            }
+            std::reverse(postorder.begin(), postorder.end());
+            return postorder;
+        }
+
+        std::vector<bool> find_reachable(const std::vector<BasicBlock> &blocks) {
+            std::vector<bool> reachable(blocks.size(), false);
+            if (blocks.empty()) {
+                return reachable;
+            }
+            std::vector<std::size_t> stack{0};
+            reachable[0] = true;
+            while (!stack.empty()) {
+                std::size_t b = stack.back();
+                stack.pop_back();
+                for (const CfgEdge &e : blocks[b].succs) {
+                    if (!reachable[e.to]) {
+                        reachable[e.to] = true;
+                        stack.push_back(e.to);
+                    }
+                }
+            }
+            return reachable;
+        }
+    } // namespace
+
+    ControlFlowGraph::ControlFlowGraph(const std::vector<Inst> &prog) {
+        std::vector<DecodedInst> code;
+        code.reserve(prog.size());
+        for (const Inst &inst : prog) {
+            code.push_back(DecodedInst::decode(inst.encode()));
+        }
+        std::size_t n = code.size();
+
+        auto is_branch = [&](std::size_t i) {
+            return !code[i].is_data && is_inst_branch(code[i].type);
+        };
+        auto target_of = [&](std::size_t i) {
+            int target = static_cast<int>(i * 2) + 2 + sign_extend(code[i].imm);
+            if (target < 0 || target % 2 != 0 || static_cast<std::size_t>(target) >= n * 2) {
+                throw AnalysisError("Branch at " + format_addr(i * 2) + " leaves the program");
+            }
+            return static_cast<std::size_t>(target / 2);
+        };
+
+        // Blocks start at the entry, at branch targets and after delay slots.
+        std::vector<bool> leader(n, false);
+        if (n != 0) {
+            leader[0] = true;
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            if (is_branch(i)) {
+                leader[target_of(i)] = true;
+                if (i + 2 < n) {
+                    leader[i + 2] = true;
+                }
+            }
+        }
+
+        std::vector<std::size_t> block_of(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            if (leader[i]) {
+                block_of[i] = blocks.size();
+                blocks.emplace_back();
+                blocks.back().start = static_cast<std::uint16_t>(i * 2);
+            }
+        }
+
+        for (BasicBlock &block : blocks) {
+            for (std::size_t i = block.start / 2; i < n && !code[i].is_data; ++i) {
+                if (leader[i] && !block.insts.empty()) {
+                    block.succs.push_back(CfgEdge{block_of[i], false});
+                    break;
+                }
+                block.insts.push_back(code[i]);
+                if (!is_branch(i)) {
+                    continue;
+                }
+
+                std::size_t target = target_of(i);
+                bool has_delay_slot = i + 1 < n && !code[i + 1].is_data;
+                bool jump = is_inst_jump(code[i].type);
+                if (jump && target == i && has_delay_slot && code[i + 1].type == InstType::NOP) {
+                    block.halts = true;
+                    break;
+                }
+                if (!has_delay_slot) {
+                    // Fails on the raw word in the delay slot.
+                    break;
+                }
+                block.insts.push_back(code[i + 1]);
+                block.succs.push_back(CfgEdge{block_of[target], true});
+                if (!jump && i + 2 < n) {
+                    block.succs.push_back(CfgEdge{block_of[i + 2], false});
+                }
+                break;
+            }
+        }
+
+        find_loops();
+    }
+
+    void ControlFlowGraph::find_loops() {
+        std::size_t n = blocks.size();
+        std::vector<bool> reachable = find_reachable(blocks);
+        preds.resize(n);
+        for (std::size_t b = 0; b < n; ++b) {
+            if (!reachable[b]) {
+                continue;
+            }
+            for (const CfgEdge &e : blocks[b].succs) {
+                preds[e.to].push_back(CfgEdge{b, e.taken});
+            }
+        }
+
+        // dom[b][d] tells whether d dominates b.
+        std::vector<std::vector<bool>> dom(n, reachable);
+        if (n != 0) {
+            dom[0].assign(n, false);
+            dom[0][0] = true;
+        }
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (std::size_t b = 1; b < n; ++b) {
+                if (!reachable[b]) {
+                    continue;
+                }
+                std::vector<bool> d = reachable;
+                for (const CfgEdge &p : preds[b]) {
+                    for (std::size_t i = 0; i < n; ++i) {
+                        d[i] = d[i] && dom[p.to][i];
+                    }
+                }
+                d[b] = true;
+                if (d != dom[b]) {
+                    dom[b] = std::move(d);
+                    changed = true;
+                }
+            }
+        }
+
+        // An edge to a dominator closes a loop, which is made of the blocks
+        // that reach the edge without going through the header.
+        std::map<std::size_t, std::set<std::size_t>> bodies;
+        for (std::size_t u = 0; u < n; ++u) {
+            if (!reachable[u]) {
+                continue;
+            }
+            for (const CfgEdge &e : blocks[u].succs) {
+                std::size_t h = e.to;
+                if (!dom[u][h]) {
+                    continue;
+                }
+                std::set<std::size_t> &body = bodies[h];
+                body.insert(h);
+                std::vector<std::size_t> stack;
+                if (body.insert(u).second) {
+                    stack.push_back(u);
+                }
+                while (!stack.empty()) {
+                    std::size_t b = stack.back();
+                    stack.pop_back();
+                    for (const CfgEdge &p : preds[b]) {
+                        if (body.insert(p.to).second) {
+                            stack.push_back(p.to);
+                        }
+                    }
+                }
+            }
+        }
+
+        for (const auto &[header, body] : bodies) {
+            loops.push_back(CfgLoop{header, std::vector<std::size_t>(body.begin(), body.end())});
+        }
+        // A loop inside another one has fewer blocks.
+        std::stable_sort(loops.begin(), loops.end(), [](const CfgLoop &a, const CfgLoop &b) {
+            return a.body.size() < b.body.size();
+        });
+    }
+
+    std::uint64_t ControlFlowGraph::get_block_cycles(const PipelineConfig &config,
+                                                     std::size_t block, const CfgEdge *pred_edge,
+                                                     std::size_t pred) const {
+        if (blocks[block].insts.empty()) {
+            return 0;
+        }
+        if (pred_edge == nullptr) {
+            return time_after(config, block, {});
+        }
+
+        // A result holds up no instruction more than n_stages - 3 after the
+        // one computing it, so only the last window instructions before the
+        // block matter, along every path to pred. The block stalls most when
+        // they ran back to back, leaving their results as late as possible.
+        std::size_t window = config.n_stages - 1;
+        std::uint64_t worst = 0;
+        std::vector<CfgEdge> history{CfgEdge{pred, pred_edge->taken}};
+        std::function<void(std::size_t)> extend = [&](std::size_t n_insts) {
+            std::size_t first = history.back().to;
+            if (n_insts >= window || first == 0 || preds[first].empty()) {
+                worst = std::max(worst, time_after(config, block, history));
+            }
+            if (n_insts >= window) {
+                return;
+            }
+            for (const CfgEdge &p : preds[first]) {
+                history.push_back(p);
+                extend(n_insts + blocks[p.to].insts.size());
+                history.pop_back();
+            }
+        };
+        extend(blocks[pred].insts.size());
+        return worst;
+    }
+
+    std::uint64_t ControlFlowGraph::time_after(const PipelineConfig &config, std::size_t block,
+                                               const std::vector<CfgEdge> &history) const {
+        PipelineModel model(config);
+        for (auto it = history.rbegin(); it != history.rend(); ++it) {
+            const BasicBlock &p = blocks[it->to];
+            for (std::size_t i = 0; i < p.insts.size(); ++i) {
+                // Only the branch before the delay slot can be taken.
+                bool taken = it->taken && i + 2 == p.insts.size();
+                model.issue_unstalled(static_cast<std::uint16_t>(p.start + i * 2), p.insts[i],
+                                      taken);
+            }
+        }
+        std::uint64_t before = history.empty() ? config.n_stages - 1 : model.get_cycle_count();
+        const BasicBlock &b = blocks[block];
+        for (std::size_t i = 0; i < b.insts.size(); ++i) {
+            model.issue(static_cast<std::uint16_t>(b.start + i * 2), b.insts[i], false);
+        }
+        return model.get_cycle_count() - before;
+    }
+
+    std::uint64_t
+    ControlFlowGraph::get_wcet(const PipelineConfig &config,
+                               const std::map<std::uint16_t, std::uint64_t> &loop_bounds) const {
+        // Nodes are the blocks, then the start, the end and the loops that
+        // have been collapsed into single nodes. An edge weighs the cycles
+        // taken from leaving one node until leaving the other.
+        std::size_t n = blocks.size();
+        std::size_t start = n;
+        std::size_t end = n + 1;
+        WeightedEdges out(n + 2);
+        std::vector<bool> alive = find_reachable(blocks);
+        alive.push_back(true);
+        alive.push_back(true);
+        if (n == 0) {
+            return 0;
+        }
+
+        add_edge(out, start, 0, get_block_cycles(config, 0));
+        for (std::size_t u = 0; u < n; ++u) {
+            if (!alive[u]) {
+                continue;
+            }
+            if (blocks[u].succs.empty()) {
+                add_edge(out, u, end, 0);
+            }
+            for (const CfgEdge &e : blocks[u].succs) {
+                add_edge(out, u, e.to, get_block_cycles(config, e.to, &e, u));
+            }
+        }
+
+        // Collapse the loops from the innermost one out. The header of a
+        // loop runs bound times: bound - 1 full iterations and one that exits.
+        std::vector<std::size_t> rep(n);
+        for (std::size_t b = 0; b < n; ++b) {
+            rep[b] = b;
+        }
+        for (const CfgLoop &loop : loops) {
+            std::uint16_t header_addr = blocks[loop.header].start;
+            auto bound_pos = loop_bounds.find(header_addr);
+            if (bound_pos == loop_bounds.end() || bound_pos->second == 0) {
+                throw AnalysisError("No bound for the loop at " + format_addr(header_addr));
+            }
+            std::uint64_t bound = bound_pos->second;
+
+            std::set<std::size_t> body;
+            for (std::size_t b : loop.body) {
+                body.insert(rep[b]);
+            }
+            std::size_t header = rep[loop.header];
+            auto in_body = [&](std::size_t node) { return body.count(node) != 0; };
+
+            std::vector<std::uint64_t> dist(out.size(), 0);
+            for (std::size_t u : topological_order(out, header, in_body)) {
+                for (const auto &[x, w] : out[u]) {
+                    if (x != header && in_body(x)) {
+                        dist[x] = std::max(dist[x], dist[u] + w);
+                    }
+                }
+            }
+            std::uint64_t iteration = 0;
+            for (std::size_t u : body) {
+                auto back = out[u].find(header);
+                if (back != out[u].end()) {
+                    iteration = std::max(iteration, dist[u] + back->second);
+                }
+            }
+
+            std::size_t collapsed = out.size();
+            out.emplace_back();
+            alive.push_back(true);
+            for (std::size_t u : body) {
+                for (const auto &[x, w] : out[u]) {
+                    if (!in_body(x)) {
+                        add_edge(out, collapsed, x, (bound - 1) * iteration + dist[u] + w);
+                    }
+                }
+            }
+            if (out[collapsed].empty()) {
+                throw AnalysisError("The loop at " + format_addr(header_addr) + " never exits");
+            }
+            for (std::size_t p = 0; p < collapsed; ++p) {
+                if (!alive[p] || in_body(p)) {
+                    continue;
+                }
+                for (auto it = out[p].begin(); it != out[p].end();) {
+                    if (!in_body(it->first)) {
+                        ++it;
+                        continue;
+                    }
+                    if (it->first != header) {
+                        throw AnalysisError("Irreducible control flow");
+                    }
+                    std::uint64_t w = it->second;
+                    it = out[p].erase(it);
+                    add_edge(out, p, collapsed, w);
+                }
+            }
+            for (std::size_t u : body) {
+                alive[u] = false;
+            }
+            for (std::size_t &r : rep) {
+                if (in_body(r)) {
+                    r = collapsed;
+                }
+            }
+        }
+
+        std::vector<std::uint64_t> dist(out.size(), 0);
+        bool ends = false;
+        for (std::size_t u : topological_order(out, start, [&](std::size_t node) {
+                 return alive[node];
+             })) {
+            ends = ends || u == end;
+            for (const auto &[x, w] : out[u]) {
+                dist[x] = std::max(dist[x], dist[u] + w);
+            }
+        }
+        if (!ends) {
+            throw AnalysisError("The program never ends");
+        }
+        return dist[end] + config.n_stages - 1;
+    }
+} // namespace exasm
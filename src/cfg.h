@@ -0,0 +1,90 @@
+#ifndef CFG_HH
+#define CFG_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "asmio.h"
+#include "pipeline.h"
+
+namespace exasm {
+    class AnalysisError : public std::runtime_error {
+    public:
+        AnalysisError(std::string message) : std::runtime_error(message) {}
+    };
+
+    class CfgEdge {
+    public:
+        std::size_t to;
+        // Whether the branch ending the block is taken on this edge.
+        bool taken;
+    };
+
+    // A branch and its delay slot end a block, so the delay slot belongs to
+    // the block of its branch even if it is also the start of another one.
+    class BasicBlock {
+    public:
+        std::uint16_t start;
+        // Instructions executed when the block runs, from start on.
+        std::vector<DecodedInst> insts;
+        std::vector<CfgEdge> succs;
+        // The "@stop j @stop" idiom. Its delay slot is not executed.
+        bool halts = false;
+    };
+
+    // A natural loop. Loops with the same header are merged.
+    class CfgLoop {
+    public:
+        std::size_t header;
+        // Sorted block indices, including the header.
+        std::vector<std::size_t> body;
+    };
+
+    // Control flow graph of a linked program loaded at address 0. Execution
+    // ends where the program halts, runs into a raw word or runs off its end.
+    class ControlFlowGraph {
+    public:
+        // Throws AnalysisError if a branch leaves the program.
+        explicit ControlFlowGraph(const std::vector<Inst> &prog);
+
+        // The entry block is the first one.
+        const std::vector<BasicBlock> &get_blocks() const { return blocks; }
+
+        // Inner loops come before the loops containing them.
+        const std::vector<CfgLoop> &get_loops() const { return loops; }
+
+        // Most cycles block adds when it runs after pred, which ends by
+        // taking the edge, whichever path led to pred. Without pred, the
+        // cycles it takes from the start.
+        std::uint64_t get_block_cycles(const PipelineConfig &config, std::size_t block,
+                                       const CfgEdge *pred_edge = nullptr,
+                                       std::size_t pred = 0) const;
+
+        // Upper bound of the cycles from the start until the program ends on
+        // the pipeline model. loop_bounds maps the address of each loop header
+        // to how many times the header runs at most each time the loop is
+        // entered. Memory accesses are assumed to take no extra cycles.
+        // Throws AnalysisError if a loop has no bound or the control flow is
+        // irreducible.
+        std::uint64_t get_wcet(const PipelineConfig &config,
+                               const std::map<std::uint16_t, std::uint64_t> &loop_bounds) const;
+
+    private:
+        std::vector<BasicBlock> blocks;
+        std::vector<CfgLoop> loops;
+        // Edges into each reachable block, each leading from the block in to.
+        std::vector<std::vector<CfgEdge>> preds;
+
+        void find_loops();
+        // Cycles block adds after the blocks of history, latest first, ran
+        // without stalls.
+        std::uint64_t time_after(const PipelineConfig &config, std::size_t block,
+                                 const std::vector<CfgEdge> &history) const;
+    };
+} // namespace exasm
+
+#endif
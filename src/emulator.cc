@@ -1,8 +1,8 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
-#include <functional>
-#include <ostream>
+#include <limits>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <variant>
@@ -13,37 +13,189 @@
 #include "insts.h"
 
 namespace exasm {
+#include "inst_traits.inc"
+
     namespace {
         std::int16_t sign_extend(std::uint8_t num) {
             return static_cast<std::int16_t>(static_cast<std::int8_t>(num));
         }
 
-        [[maybe_unused]] std::ostream &operator<<(std::ostream &out, const ExecHistory &eh) {
-            switch (eh.type) {
+        // Header byte of an ExecHistoryLog record. The low two bits hold the
+        // ExecHistoryType, the rest depends on the type.
+        constexpr std::uint8_t history_type_mask = 0x03;
+        // CHANGE_PC: delay slot state, and whether the old PC and the old
+        // branched_pc follow. Otherwise they are pc - 2 and the current one.
+        constexpr std::uint8_t history_pc_explicit = 0x04;
+        constexpr std::uint8_t history_branched_pc_explicit = 0x08;
+        constexpr std::uint8_t history_is_delay_slot = 0x10;
+        constexpr std::uint8_t history_delay_slot_rem = 0x20;
+        // CHANGE_REG: register number in bits 2-4. The old value is stored as
+        // one byte of difference to the new value if it fits.
+        constexpr std::uint8_t history_reg_shift = 2;
+        constexpr std::uint8_t history_reg_short = 0x20;
+
+        std::uint8_t history_header(ExecHistoryType type) {
+            return static_cast<std::uint8_t>(type);
+        }
+
+        std::size_t history_payload_size(std::uint8_t header) {
+            switch (static_cast<ExecHistoryType>(header & history_type_mask)) {
             case ExecHistoryType::CHANGE_PC:
-                out << "ExecHistoryType::CHANGE_PC{old_pc: " << eh.event.pc.old_pc
-                    << ", old_branched_pc: " << eh.event.pc.old_branched_pc
-                    << ", old_delay_slot_rem: " << eh.event.pc.old_delay_slot_rem
-                    << ", old_is_delay_slot: " << eh.event.pc.old_is_delay_slot << "}";
-                break;
+                return ((header & history_pc_explicit) != 0 ? 2 : 0) +
+                       ((header & history_branched_pc_explicit) != 0 ? 2 : 0);
             case ExecHistoryType::CHANGE_REG:
-                out << "ExecHistoryType::CHANGE_REG{regnum: " << +eh.event.reg.regnum
-                    << ", old_val: " << eh.event.reg.old_val << "}";
-                break;
+                return (header & history_reg_short) != 0 ? 1 : 2;
             case ExecHistoryType::CHANGE_MEM:
-                out << "ExecHistoryType::CHANGE_MEM{addr: " << eh.event.mem.addr
-                    << ", old_val: " << +eh.event.mem.old_val << "}";
-                break;
+                return 3;
             case ExecHistoryType::CHANGE_STATE:
-                out << "ExecHistoryType::CHANGE_STATE{addr: " << eh.event.state.num
-                    << ", old_val: " << +eh.event.state.old_val << "}";
-                break;
+                return 2;
             }
-            return out;
+            return 0;
+        }
+
+        std::uint8_t *put_word(std::uint8_t *p, std::uint16_t val) {
+            p[0] = static_cast<std::uint8_t>(val >> 8);
+            p[1] = static_cast<std::uint8_t>(val & 0xFF);
+            return p + 2;
+        }
+
+        std::uint16_t get_word(const std::uint8_t *p) {
+            return static_cast<std::uint16_t>((p[0] << 8) | p[1]);
         }
     } // namespace
 
-    void Emulator::load_memfile(std::istream &strm) {
+    const std::shared_ptr<PagedMemory::Page> &PagedMemory::zero_page() {
+        static const std::shared_ptr<Page> page = std::make_shared<Page>();
+        return page;
+    }
+
+    void PagedMemory::copy_to(std::uint8_t *out) const {
+        for (const std::shared_ptr<Page> &page : pages) {
+            out = std::copy(page->begin(), page->end(), out);
+        }
+    }
+
+    void ExecHistoryLog::set_budget(std::size_t budget) {
+        this->budget = budget;
+        // Keep segments large enough for a cycle and to make dropping one
+        // cheap, and keep enough of them that dropping one loses little.
+        segment_size = std::max<std::size_t>(budget / 16, max_cycle_size * 4);
+        std::size_t n = std::max<std::size_t>(budget / segment_size, 2);
+        segments.assign(n, {});
+        used.assign(n, 0);
+        cycles.assign(n, 0);
+        clear();
+    }
+
+    void ExecHistoryLog::clear() {
+        std::fill(used.begin(), used.end(), 0);
+        std::fill(cycles.begin(), cycles.end(), 0);
+        oldest = 0;
+        n_segments = 0;
+        n_cycles = 0;
+    }
+
+    void ExecHistoryLog::advance() {
+        if (n_segments == segments.size()) {
+            n_cycles -= cycles[oldest];
+            oldest = (oldest + 1) % segments.size();
+            --n_segments;
+        }
+        ++n_segments;
+        std::size_t seg = newest();
+        // Storage is allocated on first use and reused after that.
+        segments[seg].resize(segment_size);
+        used[seg] = 0;
+        cycles[seg] = 0;
+    }
+
+    void ExecHistoryLog::pop(std::size_t size, bool end_of_cycle) {
+        std::size_t seg = newest();
+        assert(size <= used[seg]);
+        used[seg] -= size;
+        if (end_of_cycle) {
+            --cycles[seg];
+            --n_cycles;
+        }
+        while (n_segments != 0 && used[newest()] == 0) {
+            --n_segments;
+        }
+        if (n_segments == 0) {
+            oldest = 0;
+        }
+    }
+
+    std::size_t ExecHistoryLog::size() const {
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < n_segments; ++i) {
+            total += used[(oldest + i) % segments.size()];
+        }
+        return total;
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::record_change_pc(const Transaction &transaction) {
+        // Records the state before the cycle. Unless the cycle leaves a delay
+        // slot, the PC only advances by 2, so usually one byte is enough.
+        std::uint8_t header = history_header(ExecHistoryType::CHANGE_PC);
+        if (is_delay_slot) {
+            header |= history_is_delay_slot;
+        }
+        assert(delay_slot_rem == 0 || delay_slot_rem == 1);
+        if (delay_slot_rem != 0) {
+            header |= history_delay_slot_rem;
+        }
+        if (transaction.leave_delay_slot) {
+            header |= history_pc_explicit;
+        }
+        if (transaction.branch && transaction.branched_pc != branched_pc) {
+            header |= history_branched_pc_explicit;
+        }
+        std::uint8_t *p = exec_history.append(history_payload_size(header) + 1, true);
+        if ((header & history_pc_explicit) != 0) {
+            p = put_word(p, transaction.fallthrough_pc);
+        }
+        if ((header & history_branched_pc_explicit) != 0) {
+            p = put_word(p, branched_pc);
+        }
+        *p = header;
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::record_change_reg(std::uint8_t regnum, std::uint16_t val) {
+        std::uint8_t header = history_header(ExecHistoryType::CHANGE_REG) |
+                              static_cast<std::uint8_t>(regnum << history_reg_shift);
+        std::int16_t diff = static_cast<std::int16_t>(reg[regnum] - val);
+        if (-128 <= diff && diff < 128) {
+            header |= history_reg_short;
+            std::uint8_t *p = exec_history.append(2, false);
+            p[0] = static_cast<std::uint8_t>(diff);
+            p[1] = header;
+        } else {
+            std::uint8_t *p = exec_history.append(3, false);
+            p = put_word(p, reg[regnum]);
+            *p = header;
+        }
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::record_change_mem(std::uint16_t addr) {
+        std::uint8_t *p = exec_history.append(4, false);
+        p = put_word(p, addr);
+        p[0] = mem[addr];
+        p[1] = history_header(ExecHistoryType::CHANGE_MEM);
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::record_change_state(std::uint8_t num) {
+        std::uint8_t *p = exec_history.append(3, false);
+        p[0] = num;
+        p[1] = priv_state[num];
+        p[2] = history_header(ExecHistoryType::CHANGE_STATE);
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::load_memfile(std::istream &strm) {
         std::string line;
 
     next:
@@ -91,7 +243,8 @@ namespace exasm {
                 b <<= 1;
                 b |= c - '0';
             }
-            mem[addr] = b;
+            mem.set(addr, b);
+            invalidate_code(addr);
 
             for (;;) {
                 if (line.size() <= off) goto next;
@@ -111,113 +264,1013 @@ namespace exasm {
                 b <<= 1;
                 b |= c - '0';
             }
-            mem[addr + 1] = b;
+            mem.set(addr + 1, b);
+            invalidate_code(addr + 1);
         }
+        discard_future();
     }
 
-    bool Emulator::should_trap(std::uint16_t addr) const {
-        auto bp = std::find(breakpoints.begin(), breakpoints.end(), addr);
-        return enable_trap && bp != breakpoints.end();
+    template <class Features>
+    bool BasicEmulator<Features>::test_break_condition(std::uint16_t addr) const {
+        auto pos = break_conditions.find(addr);
+        if (pos == break_conditions.end()) {
+            return true;
+        }
+
+        const BreakCondition &cond = pos->second;
+        std::uint16_t lhs;
+        if (cond.operand == CondOperand::REG) {
+            lhs = reg[cond.index & 0x7];
+        } else {
+            lhs = mem[cond.index];
+        }
+
+        switch (cond.op) {
+        case CondOp::EQ:
+            return lhs == cond.value;
+        case CondOp::NE:
+            return lhs != cond.value;
+        case CondOp::LT:
+            return lhs < cond.value;
+        case CondOp::LE:
+            return lhs <= cond.value;
+        case CondOp::GT:
+            return lhs > cond.value;
+        case CondOp::GE:
+            return lhs >= cond.value;
+        }
+        return true;
     }
 
-    std::uint16_t Emulator::clock() {
-        std::vector<std::function<void()>> transaction;
+    template <class Features>
+    void BasicEmulator<Features>::commit(const Transaction &transaction) {
+        if (history_enabled()) {
+            record_change_pc(transaction);
+        }
+
+        if (transaction.leave_delay_slot) {
+            is_delay_slot = false;
+            pc = branched_pc;
+        } else if (transaction.consume_delay_slot) {
+            --delay_slot_rem;
+        }
+        pc += 2;
 
+        if (transaction.branch) {
+            branched_pc = transaction.branched_pc;
+            delay_slot_rem = 1;
+            is_delay_slot = true;
+        }
+
+        for (std::size_t i = 0; i < transaction.n_writes; ++i) {
+            const Transaction::Write &w = transaction.writes[i];
+            switch (w.type) {
+            case ExecHistoryType::CHANGE_REG:
+                if (traps_enabled() && ((reg_watchpoints >> w.target) & 1) != 0) {
+                    watchpoint_hit = true;
+                }
+                write_register(static_cast<std::uint8_t>(w.target), w.val);
+                break;
+            case ExecHistoryType::CHANGE_MEM:
+                if (traps_enabled() && write_watchpoints[w.target]) {
+                    watchpoint_hit = true;
+                }
+                if (Features::validation && track_dirty) {
+                    dirty_mem.push_back(w.target);
+                }
+                if (Features::profiling && mem_access) {
+                    ++mem_access->writes[w.target];
+                }
+                write_memory(w.target, static_cast<std::uint8_t>(w.val));
+                break;
+            case ExecHistoryType::CHANGE_STATE:
+                set_priv_state(static_cast<std::uint8_t>(w.target),
+                               static_cast<std::uint8_t>(w.val));
+                break;
+            case ExecHistoryType::CHANGE_PC:
+                assert(0);
+            }
+        }
+    }
+
+    template <class Features>
+    std::uint16_t BasicEmulator<Features>::enter_cycle(Transaction &transaction) {
+        // The PC only moves on commit, so a cycle that stops early leaves
+        // the state as it was.
         if (is_delay_slot) {
             if (delay_slot_rem == 0) {
-                transaction.emplace_back([&] { is_delay_slot = false; });
-                pc = branched_pc;
-            } else {
-                transaction.emplace_back([&] { --delay_slot_rem; });
+                transaction.leave_delay_slot = true;
+                transaction.fallthrough_pc = pc;
+                return branched_pc;
             }
+            transaction.consume_delay_slot = true;
         }
-        std::uint16_t exec_addr = pc;
+        return pc;
+    }
+
+    template <class Features>
+    RunStatus BasicEmulator<Features>::begin_cycle(Transaction &transaction,
+                                                   std::uint16_t &exec_addr) {
+        exec_addr = enter_cycle(transaction);
 
         if (should_trap(exec_addr)) {
-            throw Breakpoint(exec_addr);
+            stop_addr = exec_addr;
+            return RunStatus::BREAKPOINT;
         }
+        return RunStatus::OK;
+    }
 
-        std::uint16_t bin = (mem[exec_addr] << 8) | mem[exec_addr + 1];
-        Inst inst = Inst::decode(bin);
-        transaction.emplace_back([&] {
-            if (enable_exec_history) {
-                record_exec_history(
-                    ExecHistory::of_change_pc(pc, delay_slot_rem, is_delay_slot, branched_pc));
+    template <class Features>
+    RunStatus BasicEmulator<Features>::finish_cycle(const Transaction &transaction,
+                                                    std::uint16_t exec_addr) {
+        if (Features::profiling && profile) {
+            record_profile(transaction, exec_addr);
+        }
+        unsigned mem_stall = 0;
+        if (Features::profiling && cache) {
+            for (std::size_t i = 0; i < transaction.n_writes; ++i) {
+                const Transaction::Write &w = transaction.writes[i];
+                if (w.type == ExecHistoryType::CHANGE_MEM) {
+                    cache->access(clock_count, exec_addr, w.target, true);
+                }
             }
-            pc += 2;
-        });
+            mem_stall = cache->take_stall_cycles();
+        }
+        if (Features::profiling && pipeline) {
+            pipeline->issue(exec_addr, fetch(exec_addr), transaction.branch, mem_stall);
+        }
+        if (Features::exec_history && write_index) {
+            index_writes(transaction, exec_addr);
+        }
+        commit(transaction);
+
+        ++clock_count;
+        if (Features::exec_history && clock_count == next_checkpoint) {
+            take_checkpoint(false);
+        }
+
+        if (Features::validation && shadow && !shadow_stale) {
+            std::string divergence = check_shadow(exec_addr);
+            if (!divergence.empty()) {
+                shadow_stale = true;
+                return fail(std::move(divergence));
+            }
+        }
+
+        if (traps_enabled() && watchpoint_hit) {
+            watchpoint_hit = false;
+            stop_addr = exec_addr;
+            return RunStatus::WATCHPOINT;
+        }
+
+        // "@stop j @stop" followed by nop is the idiom for stopping the program.
+        if (transaction.branch && transaction.branched_pc == exec_addr) {
+            const DecodedInst &delay_slot = fetch(exec_addr + 2);
+            if (!delay_slot.is_data && delay_slot.type == InstType::NOP) {
+                stop_addr = exec_addr;
+                return RunStatus::HALT;
+            }
+        }
+
+        return RunStatus::OK;
+    }
 
-        if (!std::holds_alternative<InstType>(inst.inst)) {
-            throw ExecutionError("Illegal instruction (you are about to execute raw word).");
+    template <class Features>
+    RunStatus BasicEmulator<Features>::step() {
+        Transaction transaction;
+        std::uint16_t exec_addr;
+
+        RunStatus status = begin_cycle(transaction, exec_addr);
+        if (status != RunStatus::OK) {
+            return status;
         }
 
-        switch (std::get<InstType>(inst.inst)) {
+        const DecodedInst &inst = fetch(exec_addr);
+        if (inst.is_data) {
+            return fail("Illegal instruction (you are about to execute raw word).");
+        }
+
+        switch (inst.type) {
 #include "executor.inc"
         default:
-            throw ExecutionError("Unsupported instruction");
+            return fail("Unsupported instruction");
         }
 
-        // commit the transaction
-        for (const std::function<void()> &f : transaction) {
-            f();
+        return finish_cycle(transaction, exec_addr);
+    }
+
+    template <class Features>
+    std::uint16_t BasicEmulator<Features>::clock() {
+        prepare_run();
+        switch (step()) {
+        case RunStatus::BREAKPOINT:
+            throw Breakpoint(stop_addr);
+        case RunStatus::ERROR:
+            throw ExecutionError(last_error);
+        default:
+            break;
         }
 
-        ++clock_count;
+        return get_next_pc();
+    }
+
+#if defined(__GNUC__) && !defined(__EMSCRIPTEN__)
+#define EXASM_THREADED_DISPATCH
+#endif
 
-        if (is_delay_slot && delay_slot_rem == 0) {
-            return branched_pc;
+    template <class Features>
+    RunStatus BasicEmulator<Features>::run(std::uint64_t max_cycles) {
+        prepare_run();
+        return execute(max_cycles);
+    }
+
+    template <class Features>
+    RunStatus BasicEmulator<Features>::execute(std::uint64_t max_cycles) {
+        RunStatus status;
+        switch (engine) {
+        case ExecEngine::THREADED:
+            status = run_threaded(max_cycles);
+            break;
+        case ExecEngine::BLOCK:
+        default:
+            status = run_blocks(max_cycles);
+            break;
         }
-        return pc;
+
+        // A failing cycle changes nothing, so the reference has to fail on
+        // it as well.
+        if (Features::validation && status == RunStatus::ERROR && shadow && !shadow_stale &&
+            shadow->step() != RunStatus::ERROR) {
+            shadow_stale = true;
+            std::string error = last_error;
+            return fail(describe_divergence(clock_count, get_next_pc(), "failed with \"" + error +
+                                                                "\" but the reference did not"));
+        }
+        return status;
+    }
+
+    template <class Features>
+    RunStatus BasicEmulator<Features>::run_threaded(std::uint64_t max_cycles) {
+        if (max_cycles == 0) {
+            return RunStatus::CYCLE_LIMIT;
+        }
+
+        Transaction transaction;
+        std::uint16_t exec_addr;
+        DecodedInst inst;
+        RunStatus status;
+
+#define EXASM_BEGIN_CYCLE()                                                                        \
+    do {                                                                                           \
+        transaction = Transaction();                                                               \
+        status = begin_cycle(transaction, exec_addr);                                              \
+        if (status != RunStatus::OK) {                                                             \
+            return status;                                                                         \
+        }                                                                                          \
+        inst = fetch(exec_addr);                                                                   \
+        if (inst.is_data) {                                                                        \
+            return fail("Illegal instruction (you are about to execute raw word).");               \
+        }                                                                                          \
+    } while (0)
+#define EXASM_FINISH_CYCLE()                                                                       \
+    do {                                                                                           \
+        status = finish_cycle(transaction, exec_addr);                                             \
+        if (status != RunStatus::OK) {                                                             \
+            return status;                                                                         \
+        }                                                                                          \
+        if (--max_cycles == 0) {                                                                   \
+            return RunStatus::CYCLE_LIMIT;                                                         \
+        }                                                                                          \
+    } while (0)
+#include "threaded_executor.inc"
+#undef EXASM_BEGIN_CYCLE
+#undef EXASM_FINISH_CYCLE
+    }
+
+    template <class Features>
+    TranslatedBlock &BasicEmulator<Features>::get_block(std::uint16_t addr) {
+        TranslatedBlock &block = blocks[addr];
+        if (block.valid) {
+            return block;
+        }
+
+        // A block runs up to the first branch and its delay slot. Raw words end
+        // the block early so that executing them reports the usual error.
+        block.start = addr;
+        block.insts.clear();
+        bool in_delay_slot = false;
+        std::uint16_t a = addr;
+        while (block.insts.size() < TranslatedBlock::max_insts) {
+            const DecodedInst &inst = fetch(a);
+            if (inst.is_data) {
+                break;
+            }
+            bool is_branch = is_inst_branch(inst.type);
+            if (in_delay_slot && is_branch) {
+                break;
+            }
+            block.insts.push_back(inst);
+            if (in_delay_slot) {
+                break;
+            }
+            in_delay_slot = is_branch;
+            a += 2;
+        }
+
+        for (std::size_t i = 0; i < block.insts.size() * 2; ++i) {
+            block_code.set(static_cast<std::uint16_t>(addr + i));
+        }
+        block.valid = true;
+        block.breakpoint_epoch = breakpoint_epoch - 1;
+        return block;
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::invalidate_blocks(std::uint16_t addr) {
+        std::uint16_t inst_addr = addr - 1;
+        for (auto &[start, block] : blocks) {
+            if (block.valid && (block.contains(addr) || block.contains(inst_addr))) {
+                block.valid = false;
+            }
+        }
+
+        // Blocks may overlap, so rebuild the map from the ones still alive.
+        block_code.reset();
+        for (const auto &[start, block] : blocks) {
+            if (!block.valid) {
+                continue;
+            }
+            for (std::size_t i = 0; i < block.insts.size() * 2; ++i) {
+                block_code.set(static_cast<std::uint16_t>(start + i));
+            }
+        }
+    }
+
+    template <class Features>
+    RunStatus BasicEmulator<Features>::run_blocks(std::uint64_t max_cycles) {
+        // Without anything to record or check on each cycle, blocks take the
+        // lean path. Blocks with breakpoints are left to step() anyway.
+        bool lean = !history_enabled() && !(Features::exec_history && write_index) &&
+                    !(Features::profiling && (profile || mem_access || pipeline || cache)) &&
+                    !(Features::validation && shadow) &&
+                    !(traps_enabled() && (has_mem_watchpoints || reg_watchpoints != 0));
+        TranslatedBlock *prev_block = nullptr;
+        while (max_cycles > 0) {
+            TranslatedBlock *block = nullptr;
+            // Only enter a block on an instruction boundary that is not inside a
+            // pending delay slot, so that its instructions run back to back.
+            if (!is_delay_slot || delay_slot_rem == 0) {
+                std::uint16_t addr = get_next_pc();
+                if (prev_block != nullptr && prev_block->successor != nullptr &&
+                    prev_block->successor->valid && prev_block->successor->start == addr) {
+                    block = prev_block->successor;
+                } else {
+                    block = &get_block(addr);
+                    if (prev_block != nullptr) {
+                        prev_block->successor = block;
+                    }
+                }
+                if (block->breakpoint_epoch != breakpoint_epoch) {
+                    block->has_breakpoint = false;
+                    for (std::size_t i = 0; i < block->insts.size(); ++i) {
+                        if (breakpoints.test(static_cast<std::uint16_t>(block->start + i * 2))) {
+                            block->has_breakpoint = true;
+                        }
+                    }
+                    block->breakpoint_epoch = breakpoint_epoch;
+                }
+                if (block->insts.empty() || (traps_enabled() && block->has_breakpoint) ||
+                    max_cycles < block->insts.size()) {
+                    block = nullptr;
+                }
+            }
+
+            prev_block = block;
+            if (block == nullptr) {
+                RunStatus status = step();
+                if (status != RunStatus::OK) {
+                    return status;
+                }
+                --max_cycles;
+                continue;
+            }
+
+            if (lean) {
+                RunStatus status = run_block_lean(*block, max_cycles);
+                if (status != RunStatus::OK) {
+                    return status;
+                }
+                continue;
+            }
+
+            for (const DecodedInst &inst : block->insts) {
+                Transaction transaction;
+                std::uint16_t exec_addr = enter_cycle(transaction);
+
+                switch (inst.type) {
+#include "executor.inc"
+                default:
+                    return fail("Unsupported instruction");
+                }
+
+                RunStatus status = finish_cycle(transaction, exec_addr);
+                --max_cycles;
+                if (status != RunStatus::OK) {
+                    return status;
+                }
+                if (!block->valid) {
+                    // The block just overwrote itself.
+                    break;
+                }
+            }
+        }
+        return RunStatus::CYCLE_LIMIT;
     }
 
-    void Emulator::set_breakpoint(std::uint16_t addr) {
-        auto pos = std::find(breakpoints.begin(), breakpoints.end(), addr);
-        if (pos == breakpoints.end()) {
-            breakpoints.push_back(addr);
+    template <class Features>
+    RunStatus BasicEmulator<Features>::run_block_lean(const TranslatedBlock &block,
+                                                      std::uint64_t &max_cycles) {
+        // Writes go straight to the state, and only the branch is left in
+        // the Transaction. The instructions run back to back from
+        // block.start, so the PC, the delay slot state and the clock are
+        // updated once from how many of them ran.
+        auto execute = [&](const DecodedInst &inst, std::uint16_t exec_addr,
+                           Transaction &transaction) -> RunStatus {
+            switch (inst.type) {
+#include "lean_executor.inc"
+            default:
+                return fail("Unsupported instruction");
+            }
+            return RunStatus::OK;
+        };
+
+        std::size_t n_done = 0;
+        std::size_t branch_index = block.insts.size();
+        std::uint16_t target = 0;
+        RunStatus status = RunStatus::OK;
+        for (const DecodedInst &inst : block.insts) {
+            std::uint16_t exec_addr = static_cast<std::uint16_t>(block.start + n_done * 2);
+            Transaction transaction;
+            status = execute(inst, exec_addr, transaction);
+            if (status != RunStatus::OK) {
+                break;
+            }
+            ++n_done;
+
+            if (transaction.branch) {
+                branch_index = n_done - 1;
+                target = transaction.branched_pc;
+                // "@stop j @stop" followed by nop stops the program.
+                if (target == exec_addr && !fetch(exec_addr + 2).is_data &&
+                    fetch(exec_addr + 2).type == InstType::NOP) {
+                    stop_addr = exec_addr;
+                    status = RunStatus::HALT;
+                    break;
+                }
+            }
+            if (!block.valid) {
+                // The block just overwrote itself.
+                break;
+            }
         }
+
+        if (n_done != 0) {
+            // The first instruction may have been the one a branch went to.
+            is_delay_slot = false;
+            pc = static_cast<std::uint16_t>(block.start + n_done * 2);
+            if (branch_index < n_done) {
+                is_delay_slot = true;
+                delay_slot_rem = branch_index + 1 < n_done ? 0 : 1;
+                branched_pc = target;
+            }
+            clock_count += n_done;
+            max_cycles -= n_done;
+        }
+        return status;
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::set_breakpoint(std::uint16_t addr) {
+        ++breakpoint_epoch;
+        breakpoints.set(addr);
+        break_conditions.erase(addr);
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::set_breakpoint(std::uint16_t addr,
+                                                 const BreakCondition &cond) {
+        ++breakpoint_epoch;
+        breakpoints.set(addr);
+        break_conditions[addr] = cond;
     }
 
-    void Emulator::remove_breakpoint(std::uint16_t addr) {
-        auto pos = std::find(breakpoints.begin(), breakpoints.end(), addr);
-        breakpoints.erase(pos);
+    template <class Features>
+    void BasicEmulator<Features>::remove_breakpoint(std::uint16_t addr) {
+        ++breakpoint_epoch;
+        breakpoints.reset(addr);
+        break_conditions.erase(addr);
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::set_mem_watchpoint(std::uint16_t addr, std::uint16_t len,
+                                                     WatchKind kind) {
+        for (std::uint16_t i = 0; i < len; ++i) {
+            std::uint16_t a = addr + i;
+            if (kind != WatchKind::WRITE) {
+                read_watchpoints.set(a);
+            }
+            if (kind != WatchKind::READ) {
+                write_watchpoints.set(a);
+            }
+        }
+        has_mem_watchpoints = read_watchpoints.any() || write_watchpoints.any();
     }
 
-    std::uint16_t Emulator::reverse_next_clock() {
-        if (!enable_exec_history) {
+    template <class Features>
+    void BasicEmulator<Features>::remove_mem_watchpoint(std::uint16_t addr, std::uint16_t len) {
+        for (std::uint16_t i = 0; i < len; ++i) {
+            read_watchpoints.reset(static_cast<std::uint16_t>(addr + i));
+            write_watchpoints.reset(static_cast<std::uint16_t>(addr + i));
+        }
+        has_mem_watchpoints = read_watchpoints.any() || write_watchpoints.any();
+    }
+
+    template <class Features>
+    std::uint16_t BasicEmulator<Features>::reverse_next_clock() {
+        if (!history_enabled()) {
             throw std::logic_error("Emulator::reverse_next_clock is available "
                                    "only if exec_history is enabled");
         }
+        if (exec_history.cycle_count() == 0) {
+            // The log has been used up, but the cycle can still be rebuilt from
+            // a checkpoint. This also refills the log up to there.
+            if (clock_count == 0 || seek_to_clock(clock_count - 1) != RunStatus::OK) {
+                throw HistoryExhausted();
+            }
+            return get_next_pc();
+        }
 
         for (;;) {
-            if (exec_history.empty()) {
-                throw std::logic_error("Broken exec_history");
-            }
-            ExecHistory eh = exec_history.back();
-            exec_history.pop_back();
-            switch (eh.type) {
+            const std::uint8_t *end = exec_history.back();
+            std::uint8_t header = end[-1];
+            std::size_t size = history_payload_size(header) + 1;
+            const std::uint8_t *p = end - size;
+            ExecHistoryType type = static_cast<ExecHistoryType>(header & history_type_mask);
+            switch (type) {
             case ExecHistoryType::CHANGE_PC:
-                pc = eh.event.pc.old_pc;
-                is_delay_slot = eh.event.pc.old_is_delay_slot;
-                branched_pc = eh.event.pc.old_branched_pc;
-                delay_slot_rem = eh.event.pc.old_delay_slot_rem + 1;
-                goto end;
-            case ExecHistoryType::CHANGE_MEM:
-                mem[eh.event.mem.addr] = eh.event.mem.old_val;
+                is_delay_slot = (header & history_is_delay_slot) != 0;
+                delay_slot_rem = (header & history_delay_slot_rem) != 0 ? 1 : 0;
+                if ((header & history_pc_explicit) != 0) {
+                    pc = get_word(p);
+                    p += 2;
+                } else {
+                    pc -= 2;
+                }
+                if ((header & history_branched_pc_explicit) != 0) {
+                    branched_pc = get_word(p);
+                }
                 break;
-            case ExecHistoryType::CHANGE_REG:
-                reg[eh.event.reg.regnum] = eh.event.reg.old_val;
+            case ExecHistoryType::CHANGE_MEM: {
+                std::uint16_t addr = get_word(p);
+                mem.set(addr, p[2]);
+                invalidate_code(addr);
+                break;
+            }
+            case ExecHistoryType::CHANGE_REG: {
+                std::uint8_t regnum = (header >> history_reg_shift) & 0x7;
+                if ((header & history_reg_short) != 0) {
+                    reg[regnum] += static_cast<std::int8_t>(p[0]);
+                } else {
+                    reg[regnum] = get_word(p);
+                }
                 break;
+            }
             case ExecHistoryType::CHANGE_STATE:
-                priv_state[eh.event.state.num] = eh.event.state.old_val;
+                priv_state[p[0]] = p[1];
+                break;
+            }
+            exec_history.pop(size, type == ExecHistoryType::CHANGE_PC);
+            if (type == ExecHistoryType::CHANGE_PC) {
                 break;
             }
         }
-    end:
 
         --clock_count;
+        shadow_stale = true;
+        if (write_index) {
+            write_index->truncate(clock_count);
+        }
 
-        return pc;
+        return get_next_pc();
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::set_enable_profile(bool enable) {
+        if (!Features::profiling || !enable) {
+            profile.reset();
+            return;
+        }
+        profile = std::make_unique<Profile>();
+        profile->pc_counts.assign(0x10000, 0);
+        profile->branch_taken.assign(0x10000, 0);
+        profile->branch_not_taken.assign(0x10000, 0);
+        profile->inst_counts.assign(n_inst_types, 0);
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::record_profile(const Transaction &transaction,
+                                                 std::uint16_t exec_addr) {
+        // Not committed yet, so this is still the instruction that ran.
+        InstType type = fetch(exec_addr).type;
+        ++profile->pc_counts[exec_addr];
+        ++profile->inst_counts[static_cast<std::size_t>(type)];
+        if (transaction.branch) {
+            ++profile->branch_taken[exec_addr];
+        } else if (is_inst_branch(type)) {
+            ++profile->branch_not_taken[exec_addr];
+        }
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::index_writes(const Transaction &transaction,
+                                               std::uint16_t exec_addr) {
+        for (std::size_t i = 0; i < transaction.n_writes; ++i) {
+            const Transaction::Write &w = transaction.writes[i];
+            if (w.type == ExecHistoryType::CHANGE_MEM) {
+                write_index->record(WriteIndex::mem_location(w.target), clock_count + 1,
+                                    exec_addr, false);
+            } else if (w.type == ExecHistoryType::CHANGE_REG) {
+                write_index->record(WriteIndex::reg_location(static_cast<std::uint8_t>(w.target)),
+                                    clock_count + 1, exec_addr, false);
+            }
+        }
+    }
+
+    template <class Features> void BasicEmulator<Features>::set_enable_validation(bool enable) {
+        if (!Features::validation || !enable) {
+            shadow.reset();
+            track_dirty = false;
+            dirty_mem.clear();
+            return;
+        }
+        shadow = std::unique_ptr<BasicEmulator>(new BasicEmulator(Uninitialized{}));
+        shadow_stale = true;
+        track_dirty = true;
+    }
+
+    template <class Features> void BasicEmulator<Features>::sync_shadow() {
+        // Only the architectural state; the shadow has no debugging features.
+        BasicEmulator &s = *shadow;
+        s.mem = mem;
+        s.reg = reg;
+        s.priv_state = priv_state;
+        s.pc = pc;
+        s.is_delay_slot = is_delay_slot;
+        s.delay_slot_rem = delay_slot_rem;
+        s.branched_pc = branched_pc;
+        s.clock_count = clock_count;
+        s.enable_trap = false;
+        s.track_dirty = true;
+        s.dirty_mem.clear();
+        dirty_mem.clear();
+        shadow_stale = false;
+    }
+
+    template <class Features>
+    std::string BasicEmulator<Features>::check_shadow(std::uint16_t exec_addr) {
+        BasicEmulator &s = *shadow;
+        if (s.step() == RunStatus::ERROR) {
+            return describe_divergence(clock_count - 1, exec_addr, "ran but the reference failed with \"" +
+                                                      s.last_error + "\"");
+        }
+
+        std::ostringstream what;
+        for (int i = 0; i < 8; ++i) {
+            if (reg[i] != s.reg[i]) {
+                what << std::hex << "r" << i << " is 0x" << reg[i] << ", expected 0x" << s.reg[i];
+                return describe_divergence(clock_count - 1, exec_addr, what.str());
+            }
+        }
+        if (get_next_pc() != s.get_next_pc() || is_delay_slot != s.is_delay_slot ||
+            delay_slot_rem != s.delay_slot_rem ||
+            (is_delay_slot && branched_pc != s.branched_pc)) {
+            return describe_divergence(clock_count - 1, exec_addr, "the control flow state differs");
+        }
+
+        dirty_mem.insert(dirty_mem.end(), s.dirty_mem.begin(), s.dirty_mem.end());
+        for (std::uint16_t addr : dirty_mem) {
+            if (mem[addr] != s.mem[addr]) {
+                what << "mem[";
+                write_addr(what, addr) << std::hex << "] is 0x" << static_cast<int>(mem[addr])
+                                       << ", expected 0x" << static_cast<int>(s.mem[addr]);
+                return describe_divergence(clock_count - 1, exec_addr, what.str());
+            }
+        }
+        dirty_mem.clear();
+        s.dirty_mem.clear();
+        return "";
+    }
+
+    template <class Features>
+    std::string BasicEmulator<Features>::describe_divergence(std::uint64_t cycle,
+                                                            std::uint16_t exec_addr,
+                                                            const std::string &what) const {
+        std::ostringstream out;
+        std::uint16_t next = exec_addr + 1;
+        std::uint16_t bin = static_cast<std::uint16_t>((mem[exec_addr] << 8) | mem[next]);
+        out << "Engine diverged from the reference in cycle " << cycle << " at ";
+        write_addr(out, exec_addr) << " (";
+        Inst::decode(bin).print_asm(out);
+        out << "): " << what << '\n' << std::hex;
+        auto write_state = [&out](const char *name, const BasicEmulator &emu) {
+            out << name;
+            for (int i = 0; i < 8; ++i) {
+                out << " r" << i << "=0x" << emu.reg[i];
+            }
+            out << " next_pc=0x" << emu.get_next_pc() << " delay_slot=" << emu.is_delay_slot << '/'
+                << emu.delay_slot_rem << " branched_pc=0x" << emu.branched_pc;
+        };
+        write_state("engine:   ", *this);
+        out << '\n';
+        write_state("reference:", *shadow);
+        return out.str();
+    }
+
+    template <class Features>
+    BasicEmulator<Features> BasicEmulator<Features>::fork() const {
+        BasicEmulator child(Uninitialized{});
+        child.mem = mem;
+        child.prog = prog;
+        child.reg = reg;
+        child.priv_state = priv_state;
+        child.engine = engine;
+
+        child.breakpoints = breakpoints;
+        child.break_conditions = break_conditions;
+        child.enable_trap = enable_trap;
+        child.read_watchpoints = read_watchpoints;
+        child.write_watchpoints = write_watchpoints;
+        child.has_mem_watchpoints = has_mem_watchpoints;
+        child.reg_watchpoints = reg_watchpoints;
+
+        child.pc = pc;
+        child.is_delay_slot = is_delay_slot;
+        child.delay_slot_rem = delay_slot_rem;
+        child.branched_pc = branched_pc;
+
+        child.enable_exec_history = enable_exec_history;
+        child.exec_history.set_budget(exec_history.get_budget());
+        child.set_enable_write_index(write_index != nullptr);
+        child.set_enable_validation(shadow != nullptr);
+        child.checkpoint_interval = checkpoint_interval;
+        child.clock_count = clock_count;
+        child.schedule_checkpoint();
+
+        child.stop_addr = stop_addr;
+        child.last_error = last_error;
+        child.set_enable_profile(profile != nullptr);
+        child.set_enable_mem_access_counts(mem_access != nullptr);
+        if (pipeline) {
+            child.set_enable_pipeline_model(true, pipeline->get_config());
+        }
+        if (cache) {
+            child.set_enable_cache_model(true, cache->get_config());
+        }
+        return child;
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::take_checkpoint(bool pinned) {
+        checkpoint_pending = false;
+
+        auto it = std::lower_bound(
+            checkpoints.begin(), checkpoints.end(), clock_count,
+            [](const Checkpoint &c, std::uint64_t clock) { return c.clock < clock; });
+        if (it == checkpoints.end() || it->clock != clock_count) {
+            it = checkpoints.insert(it, Checkpoint());
+        }
+        it->clock = clock_count;
+        it->pinned = pinned;
+        it->mem = mem;
+        it->reg = reg;
+        it->priv_state = priv_state;
+        it->pc = pc;
+        it->is_delay_slot = is_delay_slot;
+        it->delay_slot_rem = delay_slot_rem;
+        it->branched_pc = branched_pc;
+
+        // Too many checkpoints: keep every other one and take them half as often.
+        std::size_t n_periodic = std::count_if(checkpoints.begin(), checkpoints.end(),
+                                               [](const Checkpoint &c) { return !c.pinned; });
+        if (n_periodic > max_checkpoints) {
+            checkpoint_interval *= 2;
+            checkpoints.erase(std::remove_if(checkpoints.begin(), checkpoints.end(),
+                                             [this](const Checkpoint &c) {
+                                                 return !c.pinned &&
+                                                        c.clock % checkpoint_interval != 0;
+                                             }),
+                              checkpoints.end());
+        }
+
+        schedule_checkpoint();
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::restore_checkpoint(const Checkpoint &checkpoint) {
+        // Pages still shared with the checkpoint are unchanged, and so is the
+        // code translated from them.
+        for (std::size_t page = 0; page < PagedMemory::n_pages; ++page) {
+            if (mem.shares_page(checkpoint.mem, page)) {
+                continue;
+            }
+            for (std::size_t i = 0; i < PagedMemory::page_size; ++i) {
+                invalidate_code(static_cast<std::uint16_t>(page * PagedMemory::page_size + i));
+            }
+        }
+
+        clock_count = checkpoint.clock;
+        mem = checkpoint.mem;
+        reg = checkpoint.reg;
+        priv_state = checkpoint.priv_state;
+        pc = checkpoint.pc;
+        is_delay_slot = checkpoint.is_delay_slot;
+        delay_slot_rem = checkpoint.delay_slot_rem;
+        branched_pc = checkpoint.branched_pc;
+        watchpoint_hit = false;
+
+        // The log describes the cycles before the state we left.
+        exec_history.clear();
+        shadow_stale = true;
+        if (write_index) {
+            write_index->truncate(checkpoint.clock);
+        }
+        schedule_checkpoint();
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::schedule_checkpoint() {
+        if (history_enabled()) {
+            next_checkpoint = (clock_count / checkpoint_interval + 1) * checkpoint_interval;
+        } else {
+            next_checkpoint = std::numeric_limits<std::uint64_t>::max();
+        }
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::discard_future() {
+        // Re-executing from an earlier checkpoint no longer reaches the current
+        // state, so it has to be saved as it is before running on.
+        checkpoints.erase(
+            std::lower_bound(
+                checkpoints.begin(), checkpoints.end(), clock_count,
+                [](const Checkpoint &c, std::uint64_t clock) { return c.clock < clock; }),
+            checkpoints.end());
+        checkpoint_pending = true;
+        shadow_stale = true;
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::prepare_run() {
+        if (Features::validation && shadow && shadow_stale) {
+            sync_shadow();
+        }
+        if (!history_enabled()) {
+            return;
+        }
+        if (checkpoint_pending) {
+            take_checkpoint(true);
+        }
+        // Checkpoints ahead of us stay valid since execution is deterministic,
+        // up to the first change that was made from outside.
+        auto it = std::find_if(checkpoints.begin(), checkpoints.end(), [this](const Checkpoint &c) {
+            return c.pinned && c.clock > clock_count;
+        });
+        checkpoints.erase(it, checkpoints.end());
+    }
+
+    template <class Features>
+    typename BasicEmulator<Features>::ReplayState BasicEmulator<Features>::begin_replay() {
+        ReplayState state{enable_trap, std::move(profile), std::move(mem_access),
+                          std::move(pipeline), std::move(cache)};
+        enable_trap = false;
+        return state;
+    }
+
+    template <class Features>
+    void BasicEmulator<Features>::end_replay(ReplayState &state) {
+        enable_trap = state.enable_trap;
+        profile = std::move(state.profile);
+        mem_access = std::move(state.mem_access);
+        pipeline = std::move(state.pipeline);
+        cache = std::move(state.cache);
+    }
+
+    template <class Features>
+    RunStatus BasicEmulator<Features>::replay_until(std::uint64_t clock) {
+        ReplayState replay = begin_replay();
+        RunStatus status = RunStatus::OK;
+        while (clock_count < clock) {
+            status = execute(clock - clock_count);
+            if (status == RunStatus::ERROR) {
+                break;
+            }
+            status = RunStatus::OK;
+        }
+        end_replay(replay);
+        return status;
+    }
+
+    template <class Features>
+    RunStatus BasicEmulator<Features>::seek_to_clock(std::uint64_t n) {
+        if (!history_enabled()) {
+            throw std::logic_error("Emulator::seek_to_clock is available "
+                                   "only if exec_history is enabled");
+        }
+        if (checkpoint_pending) {
+            take_checkpoint(true);
+        }
+
+        auto it = std::upper_bound(
+            checkpoints.begin(), checkpoints.end(), n,
+            [](std::uint64_t clock, const Checkpoint &c) { return clock < c.clock; });
+        if (it == checkpoints.begin()) {
+            throw HistoryExhausted();
+        }
+        --it;
+        // Jumping ahead would leave out the writes on the way from the index.
+        if (n < clock_count || (it->clock > clock_count && !write_index)) {
+            restore_checkpoint(*it);
+        }
+        return replay_until(n);
+    }
+
+    template <class Features>
+    bool BasicEmulator<Features>::reverse_continue() {
+        return reverse_step_until([](const BasicEmulator &emu) {
+            std::uint16_t addr = emu.get_next_pc();
+            return emu.breakpoints[addr] && emu.test_break_condition(addr);
+        });
+    }
+
+    template <class Features>
+    bool BasicEmulator<Features>::reverse_step_until(
+        const std::function<bool(const BasicEmulator &)> &pred) {
+        if (!history_enabled()) {
+            throw std::logic_error("Emulator::reverse_step_until is available "
+                                   "only if exec_history is enabled");
+        }
+        if (checkpoint_pending) {
+            take_checkpoint(true);
+        }
+
+        // Replay the spans between checkpoints from the newest one back, and
+        // stop at the first span that has a match.
+        std::uint64_t origin = clock_count;
+        std::uint64_t end = clock_count;
+        for (;;) {
+            auto it = std::lower_bound(
+                checkpoints.begin(), checkpoints.end(), end,
+                [](const Checkpoint &c, std::uint64_t clock) { return c.clock < clock; });
+            if (it == checkpoints.begin()) {
+                break;
+            }
+            --it;
+            std::uint64_t start = it->clock;
+            restore_checkpoint(*it);
+
+            bool found = false;
+            std::uint64_t match = 0;
+            ReplayState replay = begin_replay();
+            while (clock_count < end) {
+                if (pred(*this)) {
+                    found = true;
+                    match = clock_count;
+                }
+                if (step() == RunStatus::ERROR) {
+                    break;
+                }
+            }
+            end_replay(replay);
+
+            if (found) {
+                seek_to_clock(match);
+                return true;
+            }
+            end = start;
+        }
+
+        seek_to_clock(origin);
+        return false;
+    }
+
+    template <class Features>
+    int BasicEmulator<Features>::get_estimated_clock_count() const {
+        if (pipeline) {
+            return static_cast<int>(pipeline->get_cycle_count());
+        }
+        return static_cast<int>(clock_count + 3);
     }
 
-    int Emulator::get_estimated_clock_count() const { return clock_count + 3; }
+    template class BasicEmulator<FullFeatures>;
+    template class BasicEmulator<BatchFeatures>;
 } // namespace exasm
@@ -2,12 +2,23 @@
 #define EMULATOR_HH
 
 #include <array>
+#include <bitset>
+#include <cassert>
+#include <cstdint>
+#include <functional>
 #include <istream>
+#include <memory>
+#include <optional>
 #include <random>
 #include <stdexcept>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "asmio.h"
+#include "cache.h"
+#include "pipeline.h"
+#include "write_index.h"
 
 namespace exasm {
     class ExecutionError : public std::runtime_error {
@@ -24,6 +35,72 @@ namespace exasm {
         std::uint16_t get_addr() const { return addr; };
     };
 
+    class HistoryExhausted : public std::runtime_error {
+    public:
+        HistoryExhausted() : std::runtime_error("Execution history exhausted") {}
+    };
+
+    enum class RunStatus {
+        OK,
+        BREAKPOINT,
+        ERROR,
+        CYCLE_LIMIT,
+        HALT,
+        WATCHPOINT,
+    };
+
+    enum class ExecEngine {
+        THREADED,
+        BLOCK,
+    };
+
+    class TranslatedBlock {
+    public:
+        static constexpr std::size_t max_insts = 64;
+
+        std::uint16_t start;
+        std::vector<DecodedInst> insts;
+        bool valid = false;
+        std::uint32_t breakpoint_epoch = 0;
+        bool has_breakpoint = false;
+
+        // The block that ran after this one last time. Loops mostly go the same
+        // way, so this usually saves the lookup in Emulator::blocks.
+        TranslatedBlock *successor = nullptr;
+
+        bool contains(std::uint16_t addr) const {
+            return static_cast<std::uint16_t>(addr - start) < insts.size() * 2;
+        }
+    };
+
+    enum class WatchKind {
+        READ,
+        WRITE,
+        ACCESS,
+    };
+
+    enum class CondOperand {
+        REG,
+        MEM,
+    };
+
+    enum class CondOp {
+        EQ,
+        NE,
+        LT,
+        LE,
+        GT,
+        GE,
+    };
+
+    class BreakCondition {
+    public:
+        CondOperand operand;
+        std::uint16_t index;
+        CondOp op;
+        std::uint16_t value;
+    };
+
     enum class ExecHistoryType {
         CHANGE_PC,
         CHANGE_MEM,
@@ -31,109 +108,410 @@ namespace exasm {
         CHANGE_STATE,
     };
 
-    class ExecHistory {
+    class Transaction {
+    public:
+        static constexpr std::size_t max_writes = 4;
+
+        struct Write {
+            ExecHistoryType type;
+            std::uint16_t target;
+            std::uint16_t val;
+        };
+
+        std::array<Write, max_writes> writes;
+        std::size_t n_writes = 0;
+
+        bool leave_delay_slot = false;
+        bool consume_delay_slot = false;
+        // PC before the jump to branched_pc, if the cycle leaves a delay slot.
+        std::uint16_t fallthrough_pc = 0;
+        bool branch = false;
+        std::uint16_t branched_pc = 0;
+
+        void set_register(std::uint8_t regnum, std::uint16_t val) {
+            push(ExecHistoryType::CHANGE_REG, regnum, val);
+        }
+
+        void set_memory(std::uint16_t addr, std::uint8_t val) {
+            push(ExecHistoryType::CHANGE_MEM, addr, val);
+        }
+
+        void set_priv_state(std::uint8_t num, std::uint8_t val) {
+            push(ExecHistoryType::CHANGE_STATE, num, val);
+        }
+
+        void branch_to(std::uint16_t addr) {
+            branch = true;
+            branched_pc = addr;
+        }
+
+    private:
+        void push(ExecHistoryType type, std::uint16_t target, std::uint16_t val) {
+            assert(n_writes < max_writes);
+            writes[n_writes++] = Write{type, target, val};
+        }
+    };
+
+    // Bounded log of undo records for reverse execution. Records are variable
+    // length and written with their header byte last, so the log is read
+    // backwards from the newest record. The budget is split into segments and
+    // the oldest segment is dropped as a whole when the log is full. All
+    // records of one cycle are kept in the same segment.
+    class ExecHistoryLog {
     public:
-        ExecHistoryType type;
-        union {
-            struct {
-                std::uint16_t old_pc;
-                std::uint16_t old_delay_slot_rem;
-                std::uint16_t old_branched_pc;
-                bool old_is_delay_slot;
-            } pc;
-            struct {
-                std::uint16_t addr;
-                std::uint8_t old_val;
-            } mem;
-            struct {
-                std::uint8_t regnum;
-                std::uint16_t old_val;
-            } reg;
-            struct {
-                std::uint8_t num;
-                std::uint16_t old_val;
-            } state;
-        } event;
-
-        static ExecHistory of_change_pc(std::uint16_t old_pc, int old_delay_slot_rem,
-                                        bool old_is_delay_slot, std::uint16_t old_branched_pc) {
-            ExecHistory eh;
-            eh.type = ExecHistoryType::CHANGE_PC;
-            eh.event.pc.old_pc = old_pc;
-            eh.event.pc.old_delay_slot_rem = old_delay_slot_rem;
-            eh.event.pc.old_branched_pc = old_branched_pc;
-            eh.event.pc.old_is_delay_slot = old_is_delay_slot;
-            return eh;
-        }
-
-        static ExecHistory of_change_mem(std::uint16_t addr, std::uint8_t old_val) {
-            ExecHistory eh;
-            eh.type = ExecHistoryType::CHANGE_MEM;
-            eh.event.mem.addr = addr;
-            eh.event.mem.old_val = old_val;
-            return eh;
-        }
-
-        static ExecHistory of_change_reg(std::uint8_t regnum, std::uint16_t old_val) {
-            ExecHistory eh;
-            eh.type = ExecHistoryType::CHANGE_REG;
-            eh.event.reg.regnum = regnum;
-            eh.event.reg.old_val = old_val;
-            return eh;
-        }
-
-        static ExecHistory of_change_state(std::uint8_t num, std::uint8_t old_val) {
-            ExecHistory eh;
-            eh.type = ExecHistoryType::CHANGE_STATE;
-            eh.event.state.num = num;
-            eh.event.state.old_val = old_val;
-            return eh;
-        }
-    };
-
-    class Emulator {
-        std::array<std::uint8_t, 0x10000> mem;
+        static constexpr std::size_t max_record_size = 5;
+        static constexpr std::size_t max_cycle_size =
+            max_record_size * (1 + Transaction::max_writes);
+        static constexpr std::size_t default_budget = 16 << 20;
+
+        ExecHistoryLog() { set_budget(default_budget); }
+
+        void set_budget(std::size_t budget);
+        std::size_t get_budget() const { return budget; }
+        void clear();
+
+        // Returns the space for a record of size bytes. If new_cycle is set,
+        // a whole cycle is guaranteed to fit in the current segment.
+        std::uint8_t *append(std::size_t size, bool new_cycle) {
+            std::size_t need = new_cycle ? max_cycle_size : size;
+            if (n_segments == 0 || segment_size - used[newest()] < need) {
+                advance();
+            }
+            std::size_t seg = newest();
+            std::uint8_t *p = segments[seg].data() + used[seg];
+            used[seg] += size;
+            if (new_cycle) {
+                ++cycles[seg];
+                ++n_cycles;
+            }
+            return p;
+        }
+
+        // Number of cycles that can be undone.
+        std::size_t cycle_count() const { return n_cycles; }
+
+        // Returns one past the header byte of the newest record.
+        const std::uint8_t *back() const {
+            std::size_t seg = newest();
+            return segments[seg].data() + used[seg];
+        }
+
+        // Drops the newest record, which is size bytes long.
+        void pop(std::size_t size, bool end_of_cycle);
+
+        // Number of bytes held by records.
+        std::size_t size() const;
+
+    private:
+        std::size_t budget = 0;
+        std::vector<std::vector<std::uint8_t>> segments;
+        std::vector<std::size_t> used;
+        std::vector<std::size_t> cycles;
+        std::size_t segment_size = 0;
+        std::size_t oldest = 0;
+        std::size_t n_segments = 0;
+        std::size_t n_cycles = 0;
+
+        std::size_t newest() const { return (oldest + n_segments - 1) % segments.size(); }
+
+        void advance();
+    };
+
+    // The 64 KiB address space split into pages shared copy-on-write between
+    // copies, so copying it only copies the page table.
+    class PagedMemory {
+    public:
+        static constexpr std::size_t page_bits = 8;
+        static constexpr std::size_t page_size = 1 << page_bits;
+        static constexpr std::size_t n_pages = 0x10000 / page_size;
+
+        using Page = std::array<std::uint8_t, page_size>;
+
+        // All pages start out as one shared zero page.
+        PagedMemory() { pages.fill(zero_page()); }
+
+        std::uint8_t operator[](std::uint16_t addr) const {
+            return (*pages[addr >> page_bits])[addr & (page_size - 1)];
+        }
+
+        void set(std::uint16_t addr, std::uint8_t val) {
+            std::shared_ptr<Page> &page = pages[addr >> page_bits];
+            // Only this copy holds the page unless another one was made since.
+            if (page.use_count() != 1) {
+                page = std::make_shared<Page>(*page);
+            }
+            (*page)[addr & (page_size - 1)] = val;
+        }
+
+        // Whether the page is the same one as in other, so it cannot differ.
+        bool shares_page(const PagedMemory &other, std::size_t page) const {
+            return pages[page] == other.pages[page];
+        }
+
+        // Copies the contents to a flat buffer of 0x10000 bytes.
+        void copy_to(std::uint8_t *out) const;
+
+    private:
+        std::array<std::shared_ptr<Page>, n_pages> pages;
+
+        static const std::shared_ptr<Page> &zero_page();
+    };
+
+    // Execution counts collected while profiling is enabled.
+    class Profile {
+    public:
+        // Indexed by the address of the executed instruction.
+        std::vector<std::uint64_t> pc_counts;
+        std::vector<std::uint64_t> branch_taken;
+        std::vector<std::uint64_t> branch_not_taken;
+        // Indexed by InstType.
+        std::vector<std::uint64_t> inst_counts;
+    };
+
+    // Data memory accesses made by the program, counted per byte.
+    class MemAccessCounts {
+    public:
+        std::vector<std::uint32_t> reads = std::vector<std::uint32_t>(0x10000);
+        std::vector<std::uint32_t> writes = std::vector<std::uint32_t>(0x10000);
+    };
+
+    // Full state of the machine at the start of a cycle.
+    class Checkpoint {
+    public:
+        std::uint64_t clock;
+        // Taken right after the state was changed from outside, so it cannot be
+        // reproduced by re-executing from an earlier checkpoint.
+        bool pinned;
+        PagedMemory mem;
+        std::array<std::uint16_t, 8> reg;
+        std::array<std::uint8_t, 256> priv_state;
+        std::uint16_t pc;
+        bool is_delay_slot;
+        int delay_slot_rem;
+        std::uint16_t branched_pc;
+    };
+
+    // Compile-time feature sets for BasicEmulator. The checks for a feature
+    // that is left out are compiled away. Its settings are then accepted but
+    // have no effect, and time travel throws std::logic_error.
+    class FullFeatures {
+    public:
+        // Execution history, checkpoints and time travel.
+        static constexpr bool exec_history = true;
+        // Breakpoints and watchpoints.
+        static constexpr bool traps = true;
+        // Profile and memory access counts.
+        static constexpr bool profiling = true;
+        // Word accesses to odd addresses fail instead of using the address as is.
+        static constexpr bool alignment_checks = true;
+        // Checking the execution engines against the reference interpreter.
+        static constexpr bool validation = true;
+    };
+
+    // Just runs programs, for batch jobs that only want the final state.
+    class BatchFeatures {
+    public:
+        static constexpr bool exec_history = false;
+        static constexpr bool traps = false;
+        static constexpr bool profiling = false;
+        static constexpr bool alignment_checks = false;
+        static constexpr bool validation = false;
+    };
+
+    template <class Features> class BasicEmulator {
+        PagedMemory mem;
         std::vector<Inst> prog;
         std::array<std::uint16_t, 8> reg;
         std::array<std::uint8_t, 256> priv_state;
 
-        std::vector<std::uint16_t> breakpoints;
+        std::unordered_map<std::uint16_t, TranslatedBlock> blocks;
+        std::bitset<0x10000> block_code;
+        ExecEngine engine = ExecEngine::BLOCK;
+
+        std::bitset<0x10000> breakpoints;
+        std::unordered_map<std::uint16_t, BreakCondition> break_conditions;
+        std::uint32_t breakpoint_epoch = 0;
         bool enable_trap = true;
 
+        std::bitset<0x10000> read_watchpoints;
+        std::bitset<0x10000> write_watchpoints;
+        // Whether any bit of read_watchpoints or write_watchpoints is set.
+        bool has_mem_watchpoints = false;
+        std::uint8_t reg_watchpoints = 0;
+        bool watchpoint_hit = false;
+
         std::uint16_t pc = 0;
         bool is_delay_slot = false;
         int delay_slot_rem = 0;
-        std::uint16_t branched_pc;
+        std::uint16_t branched_pc = 0;
 
         bool enable_exec_history = false;
-        std::vector<ExecHistory> exec_history;
-
-        int clock_count = 0;
+        ExecHistoryLog exec_history;
+        // Null unless enabled.
+        std::unique_ptr<WriteIndex> write_index;
+
+        static constexpr std::size_t max_checkpoints = 64;
+        std::vector<Checkpoint> checkpoints;
+        std::uint64_t checkpoint_interval = 1 << 16;
+        std::uint64_t next_checkpoint = 0;
+        bool checkpoint_pending = true;
+
+        std::uint64_t clock_count = 0;
+
+        // Null unless enabled, so that they only cost a test.
+        std::unique_ptr<Profile> profile;
+        std::unique_ptr<MemAccessCounts> mem_access;
+        std::unique_ptr<PipelineModel> pipeline;
+        std::unique_ptr<CacheModel> cache;
+
+        // Reference interpreter run in lockstep while validating. It is
+        // stale after the state was changed other than by executing, and is
+        // copied again before the next run.
+        std::unique_ptr<BasicEmulator> shadow;
+        bool shadow_stale = false;
+        // Memory written since the last comparison with the shadow, recorded
+        // by both of them.
+        bool track_dirty = false;
+        std::vector<std::uint16_t> dirty_mem;
+
+        // Debugging state put aside while cycles are re-executed for time travel.
+        struct ReplayState {
+            bool enable_trap;
+            std::unique_ptr<Profile> profile;
+            std::unique_ptr<MemAccessCounts> mem_access;
+            std::unique_ptr<PipelineModel> pipeline;
+            std::unique_ptr<CacheModel> cache;
+        };
+
+        std::uint16_t stop_addr = 0;
+        std::string last_error;
 
         void set_pc(std::uint16_t pc) { this->pc = pc; }
 
-        void record_exec_history(ExecHistory hist) { exec_history.push_back(std::move(hist)); }
+        void record_change_pc(const Transaction &transaction);
+        void record_change_reg(std::uint8_t regnum, std::uint16_t val);
+        void record_change_mem(std::uint16_t addr);
+        void record_change_state(std::uint8_t num);
+
+        bool history_enabled() const { return Features::exec_history && enable_exec_history; }
 
         void set_priv_state(std::uint8_t num, std::uint8_t val) {
-            if (enable_exec_history) {
-                record_exec_history(ExecHistory::of_change_state(num, val));
+            if (history_enabled()) {
+                record_change_state(num);
             }
 
             priv_state[num] = val;
         }
 
+        void write_memory(std::uint16_t addr, std::uint8_t val) {
+            if (history_enabled()) {
+                record_change_mem(addr);
+            }
+
+            mem.set(addr, val);
+            invalidate_code(addr);
+        }
+
+        void write_register(std::uint8_t regnum, std::uint16_t val) {
+            if (history_enabled()) {
+                record_change_reg(regnum, val);
+            }
+
+            reg[regnum] = val;
+        }
+
+        // Writes made by run_block_lean(), which records and checks nothing.
+        void set_register_lean(std::uint8_t regnum, std::uint16_t val) { reg[regnum] = val; }
+
+        void set_memory_lean(std::uint16_t addr, std::uint8_t val) {
+            mem.set(addr, val);
+            invalidate_code(addr);
+        }
+
+        void set_priv_state_lean(std::uint8_t num, std::uint8_t val) { priv_state[num] = val; }
+
+        void record_profile(const Transaction &transaction, std::uint16_t exec_addr);
+        void sync_shadow();
+        std::string check_shadow(std::uint16_t exec_addr);
+        std::string describe_divergence(std::uint64_t cycle, std::uint16_t exec_addr,
+                                        const std::string &what) const;
+        void index_writes(const Transaction &transaction, std::uint16_t exec_addr);
+
+        ReplayState begin_replay();
+        void end_replay(ReplayState &state);
+
+        void take_checkpoint(bool pinned);
+        void restore_checkpoint(const Checkpoint &checkpoint);
+        void schedule_checkpoint();
+        void discard_future();
+        void prepare_run();
+        RunStatus replay_until(std::uint64_t clock);
+
         std::uint8_t get_priv_state(std::uint8_t num) { return priv_state[num]; }
 
-        bool should_trap(std::uint16_t addr) const;
+        bool traps_enabled() const { return Features::traps && enable_trap; }
+
+        bool should_trap(std::uint16_t addr) const {
+            return traps_enabled() && breakpoints[addr] && test_break_condition(addr);
+        }
+
+        bool test_break_condition(std::uint16_t addr) const;
+
+        std::uint8_t load_memory(std::uint16_t exec_addr, std::uint16_t addr) {
+            if (traps_enabled() && read_watchpoints[addr]) {
+                watchpoint_hit = true;
+            }
+            if (Features::profiling && mem_access) {
+                ++mem_access->reads[addr];
+            }
+            if (Features::profiling && cache) {
+                cache->access(clock_count, exec_addr, addr, false);
+            }
+            return mem[addr];
+        }
+
+        void invalidate_code(std::uint16_t addr) {
+            if (block_code[addr]) {
+                invalidate_blocks(addr);
+            }
+        }
+
+        void invalidate_blocks(std::uint16_t addr);
+
+        const DecodedInst &fetch(std::uint16_t addr) const {
+            std::uint16_t next = addr + 1;
+            return DecodedInst::decode(static_cast<std::uint16_t>((mem[addr] << 8) | mem[next]));
+        }
+
+        TranslatedBlock &get_block(std::uint16_t addr);
+        void commit(const Transaction &transaction);
+
+        RunStatus fail(std::string message) {
+            watchpoint_hit = false;
+            last_error = std::move(message);
+            return RunStatus::ERROR;
+        }
+
+        std::uint16_t enter_cycle(Transaction &transaction);
+        RunStatus begin_cycle(Transaction &transaction, std::uint16_t &exec_addr);
+        RunStatus finish_cycle(const Transaction &transaction, std::uint16_t exec_addr);
+        RunStatus step();
+        RunStatus execute(std::uint64_t max_cycles);
+        RunStatus run_threaded(std::uint64_t max_cycles);
+        RunStatus run_blocks(std::uint64_t max_cycles);
+        RunStatus run_block_lean(const TranslatedBlock &block, std::uint64_t &max_cycles);
+
+        struct Uninitialized {};
+        explicit BasicEmulator(Uninitialized) {}
 
     public:
-        Emulator() {
+        BasicEmulator() {
             std::random_device seed_gen;
             std::default_random_engine engine(seed_gen());
 
             std::uniform_int_distribution<> dist(0, 255);
             for (std::size_t i = 0; i < 0x10000; ++i) {
-                mem[i] = dist(engine);
+                mem.set(i, dist(engine));
             }
 
             reg.fill(0);
@@ -141,54 +519,224 @@ namespace exasm {
 
         void set_enable_exec_history(bool enable) {
             enable_exec_history = enable;
-            if (enable_exec_history && !enable) {
+            if (!enable) {
                 exec_history.clear();
+                checkpoints.clear();
+                checkpoint_pending = true;
             }
+            schedule_checkpoint();
+        }
+
+        // Sets how many cycles apart checkpoints are taken. The interval grows
+        // when there are too many of them.
+        void set_checkpoint_interval(std::uint64_t cycles) {
+            checkpoint_interval = cycles;
+            schedule_checkpoint();
         }
 
-        const std::array<std::uint8_t, 0x10000> &get_memory() const { return mem; }
+        // Limits the memory used by the execution history. Older cycles are
+        // forgotten once it is full. The history recorded so far is cleared.
+        void set_exec_history_budget(std::size_t bytes) { exec_history.set_budget(bytes); }
+
+        std::size_t get_exec_history_size() const { return exec_history.size(); }
+
+        std::size_t get_exec_history_cycles() const { return exec_history.cycle_count(); }
+
+        // Starts indexing the writes to memory and registers made from now
+        // on, so that the last one to a location is found without stepping
+        // back. The index follows time travel. Changes made from outside are
+        // forgotten once time travel goes back past them.
+        void set_enable_write_index(bool enable) {
+            if (Features::exec_history && enable) {
+                write_index = std::make_unique<WriteIndex>();
+            } else {
+                write_index.reset();
+            }
+        }
+
+        // The last write to mem[addr] seen by the current cycle, or nullopt
+        // if none has been indexed.
+        std::optional<WriteRecord> find_last_mem_write(std::uint16_t addr) const {
+            if (!write_index) {
+                return std::nullopt;
+            }
+            return write_index->find_last_write(WriteIndex::mem_location(addr), clock_count);
+        }
+
+        // The last write to register regnum seen by the current cycle, or
+        // nullopt if none has been indexed.
+        std::optional<WriteRecord> find_last_reg_write(std::uint8_t regnum) const {
+            if (!write_index) {
+                return std::nullopt;
+            }
+            return write_index->find_last_write(WriteIndex::reg_location(regnum), clock_count);
+        }
+
+        BasicEmulator(const BasicEmulator &) = delete;
+        BasicEmulator &operator=(const BasicEmulator &) = delete;
+        BasicEmulator(BasicEmulator &&) = default;
+        BasicEmulator &operator=(BasicEmulator &&) = default;
+
+        // Returns an emulator in the same state that shares all memory pages
+        // with this one until either writes to them. Breakpoints, watchpoints
+        // and settings are copied; the execution history starts out empty.
+        BasicEmulator fork() const;
+
+        const PagedMemory &get_memory() const { return mem; }
 
         std::uint8_t get_memory(std::uint16_t addr) const { return mem[addr]; }
 
         void set_memory(std::uint16_t addr, std::uint8_t val) {
-            if (enable_exec_history) {
-                record_exec_history(ExecHistory::of_change_mem(addr, mem[addr]));
+            if (Features::exec_history && write_index) {
+                write_index->record(WriteIndex::mem_location(addr), clock_count, 0, true);
             }
-
-            mem[addr] = val;
+            write_memory(addr, val);
+            discard_future();
         }
 
         const std::array<std::uint16_t, 8> &get_register() const { return reg; }
 
         void set_register(std::uint8_t regnum, std::uint16_t val) {
-            if (enable_exec_history) {
-                record_exec_history(ExecHistory::of_change_reg(regnum, reg[regnum]));
+            if (Features::exec_history && write_index) {
+                write_index->record(WriteIndex::reg_location(regnum), clock_count, 0, true);
             }
-
-            reg[regnum] = val;
+            write_register(regnum, val);
+            discard_future();
         }
 
         void set_program(const std::vector<Inst> &prog) {
             std::uint16_t addr = 0;
             for (const Inst &inst : prog) {
                 std::uint16_t bin = inst.encode();
-                mem[addr] = static_cast<std::uint8_t>(bin >> 8);
-                mem[addr + 1] = static_cast<std::uint8_t>(bin & 0xFF);
+                mem.set(addr, static_cast<std::uint8_t>(bin >> 8));
+                mem.set(addr + 1, static_cast<std::uint8_t>(bin & 0xFF));
+                invalidate_code(addr);
+                invalidate_code(addr + 1);
                 addr += 2;
             }
+            discard_future();
         }
 
         void load_memfile(std::istream &strm);
         void set_breakpoint(std::uint16_t addr);
+        void set_breakpoint(std::uint16_t addr, const BreakCondition &cond);
         void remove_breakpoint(std::uint16_t addr);
+        void set_mem_watchpoint(std::uint16_t addr, std::uint16_t len, WatchKind kind);
+        void remove_mem_watchpoint(std::uint16_t addr, std::uint16_t len);
+        void set_reg_watchpoint(std::uint8_t regnum) { reg_watchpoints |= 1 << regnum; }
+        void remove_reg_watchpoint(std::uint8_t regnum) { reg_watchpoints &= ~(1 << regnum); }
         void set_enable_trap(bool enable) { enable_trap = enable; }
 
         std::uint16_t clock();
 
+        RunStatus run(std::uint64_t max_cycles);
+
+        void set_engine(ExecEngine engine) { this->engine = engine; }
+
+        std::uint16_t get_next_pc() const {
+            if (is_delay_slot && delay_slot_rem == 0) {
+                return branched_pc;
+            }
+            return pc;
+        }
+
+        std::uint16_t get_stop_addr() const { return stop_addr; }
+
+        const std::string &get_last_error() const { return last_error; }
+
+        // Undoes the last cycle. Throws HistoryExhausted without changing
+        // anything if the cycle is no longer in the history.
         std::uint16_t reverse_next_clock();
 
+        // Time travel through checkpoints taken while the execution history is
+        // enabled. Each restores the nearest earlier checkpoint and executes
+        // forward from there with breakpoints and watchpoints ignored.
+
+        // Moves to the start of cycle n. Returns ERROR if execution fails on
+        // the way forward, and throws HistoryExhausted if n is before the
+        // oldest checkpoint.
+        RunStatus seek_to_clock(std::uint64_t n);
+
+        // Moves back to the latest earlier cycle that would stop at a
+        // breakpoint. Returns false and stays at the current cycle if there is none.
+        bool reverse_continue();
+
+        // Moves back to the latest earlier cycle whose starting state
+        // satisfies pred. Returns false and stays at the current cycle if there is
+        // none.
+        bool reverse_step_until(const std::function<bool(const BasicEmulator &)> &pred);
+
+        std::uint64_t get_clock_count() const { return clock_count; }
+
+        // Starts counting executions per address, branch outcomes per branch
+        // and executions per InstType from zero. Cycles re-executed for time
+        // travel are not counted.
+        void set_enable_profile(bool enable);
+
+        // Null if profiling is disabled.
+        const Profile *get_profile() const { return profile.get(); }
+
+        // Starts counting the bytes read and written by load and store
+        // instructions from zero. Changes made through set_memory() are not
+        // counted, nor are cycles re-executed for time travel.
+        void set_enable_mem_access_counts(bool enable) {
+            if (Features::profiling && enable) {
+                mem_access = std::make_unique<MemAccessCounts>();
+            } else {
+                mem_access.reset();
+            }
+        }
+
+        // Null if counting is disabled.
+        const MemAccessCounts *get_mem_access_counts() const { return mem_access.get(); }
+
+        // Starts timing the instructions executed from now on on a pipeline
+        // shaped by config. Like the profile, this does not follow time
+        // travel. Throws std::invalid_argument if config is not supported.
+        void set_enable_pipeline_model(bool enable, const PipelineConfig &config = {}) {
+            if (Features::profiling && enable) {
+                pipeline = std::make_unique<PipelineModel>(config);
+            } else {
+                pipeline.reset();
+            }
+        }
+
+        // Null if the pipeline model is disabled.
+        const PipelineModel *get_pipeline_model() const { return pipeline.get(); }
+
+        // Starts simulating a data cache shaped by config from empty. Its
+        // misses stall the pipeline model. Like the profile, this does not
+        // follow time travel. Throws std::invalid_argument if config is not
+        // supported.
+        void set_enable_cache_model(bool enable, const CacheConfig &config = {}) {
+            if (Features::profiling && enable) {
+                cache = std::make_unique<CacheModel>(config);
+            } else {
+                cache.reset();
+            }
+        }
+
+        // Null if the cache model is disabled.
+        const CacheModel *get_cache_model() const { return cache.get(); }
+
+        // Runs every cycle executed from now on again on a copy of the state
+        // with step(), the reference interpreter, and compares the registers,
+        // the PC and delay slot state and the memory written by either. The
+        // first difference fails execution with a description of both states.
+        // Cycles re-executed for time travel are not checked.
+        void set_enable_validation(bool enable);
+
+        // Cycles taken on the pipeline model if it is enabled. Otherwise a
+        // rough guess that ignores stalls.
         int get_estimated_clock_count() const;
     };
+
+    // Instantiated in emulator.cc.
+    extern template class BasicEmulator<FullFeatures>;
+    extern template class BasicEmulator<BatchFeatures>;
+
+    using Emulator = BasicEmulator<FullFeatures>;
+    using BatchEmulator = BasicEmulator<BatchFeatures>;
 } // namespace exasm
 
 #endif
@@ -1,15 +1,31 @@
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <istream>
 
 #include "asmio.h"
 
-int main() {
+int main(int argc, char **argv) {
+    // With --fill-delay-slots, independent instructions are moved into the
+    // delay slots of branches. With --long-jumps, the program is followed by
+    // what routing branches through trampolines cost.
+    bool fill_delay_slots = false;
+    bool long_jumps = false;
+    for (; argc > 1; --argc, ++argv) {
+        if (std::strcmp(argv[1], "--fill-delay-slots") == 0) {
+            fill_delay_slots = true;
+        } else if (std::strcmp(argv[1], "--long-jumps") == 0) {
+            long_jumps = true;
+        } else {
+            break;
+        }
+    }
     exasm::AsmReader reader(std::cin);
 
     std::uint16_t addr = 0;
     try {
         exasm::RawAsm raw_asm = reader.read_all();
+        raw_asm.set_fill_delay_slots(fill_delay_slots);
         for (exasm::Inst &i : raw_asm.get_executable()) {
             exasm::write_addr(std::cout, addr) << ' ';
             i.print_bin(std::cout);
@@ -18,6 +34,18 @@ int main() {
             std::cout << '\n';
             addr += 2;
         }
+        if (long_jumps) {
+            const exasm::LongJumpReport &report = raw_asm.get_long_jumps();
+            for (const exasm::LongJumpReport::Site &site : report.sites) {
+                std::cout << "// ";
+                exasm::write_addr(std::cout, site.addr) << " -> ";
+                exasm::write_addr(std::cout, site.dest)
+                    << ": hops " << site.hops << ", cycles +" << 2 * site.hops << ", insts "
+                    << site.own_insts << " own + " << site.shared_insts << " shared\n";
+            }
+            std::cout << "// inserted insts " << report.inserted_insts << ", skipping islands "
+                      << report.skip_insts << '\n';
+        }
     } catch (const exasm::ParseError &e) {
         std::cerr << e.what() << '\n';
     } catch (const exasm::LinkError &e) {
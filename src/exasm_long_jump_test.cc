@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "asmio.h"
+#include "insts.h"
+
+namespace {
+    enum class Kind {
+        OP,
+        LI,
+        BRANCH,
+        JUMP,
+        DELAY_SLOT,
+    };
+
+    class Line {
+    public:
+        Kind kind;
+        // Line the branch or jump goes to, counted from 0.
+        std::size_t target;
+    };
+
+    // A program of insts instructions where branch_permille of a thousand
+    // lines branch or jump up to span lines away, and a few are .li.
+    std::vector<Line> generate(std::uint32_t seed, std::size_t insts,
+                               std::uint32_t branch_permille, std::size_t span) {
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<std::uint32_t> permille(0, 999);
+        std::vector<Line> lines;
+        while (lines.size() < insts) {
+            std::size_t i = lines.size();
+            std::uint32_t roll = permille(rng);
+            if (roll < branch_permille && i + 2 < insts) {
+                std::uniform_int_distribution<std::size_t> targets(
+                    i < span ? 0 : i - span, std::min(i + span, insts - 1));
+                std::size_t target = targets(rng);
+                lines.push_back(Line{roll % 4 == 0 ? Kind::JUMP : Kind::BRANCH, target});
+                lines.push_back(Line{Kind::DELAY_SLOT, 0});
+            } else if (roll % 64 == 0 && i + 2 < insts) {
+                lines.push_back(Line{Kind::LI, 0});
+            } else {
+                lines.push_back(Line{Kind::OP, 0});
+            }
+        }
+        return lines;
+    }
+
+    std::string write_source(const std::vector<Line> &lines) {
+        std::vector<bool> labelled(lines.size(), false);
+        for (const Line &line : lines) {
+            if (line.kind == Kind::BRANCH || line.kind == Kind::JUMP) {
+                labelled[line.target] = true;
+            }
+        }
+        std::ostringstream out;
+        for (std::size_t i = 0; i < lines.size(); ++i) {
+            if (labelled[i]) {
+                out << "@l" << i << ' ';
+            }
+            switch (lines[i].kind) {
+            case Kind::OP:
+                out << "addi r2, 1\n";
+                break;
+            case Kind::LI:
+                out << ".li r3, 0x1234\n";
+                break;
+            case Kind::BRANCH:
+                out << (i % 2 == 0 ? "bnez" : "beqz") << " r1, @l" << lines[i].target << '\n';
+                break;
+            case Kind::JUMP:
+                out << "j @l" << lines[i].target << '\n';
+                break;
+            case Kind::DELAY_SLOT:
+                out << "nop\n";
+                break;
+            }
+        }
+        return out.str();
+    }
+
+    // Why the linked program doesn't do what lines say, or nothing if it does.
+    std::optional<std::string> check(const std::vector<Line> &lines,
+                                     const std::vector<exasm::Inst> &exe,
+                                     const exasm::DebugInfo &info) {
+        // Source lines of instructions, 0 for those the assembler added.
+        std::vector<std::uint32_t> exe_lines(exe.size());
+        for (std::size_t i = 0; i < exe.size(); ++i) {
+            exe_lines[i] = info.find_line(static_cast<std::uint16_t>(2 * i));
+        }
+        std::vector<std::size_t> start(lines.size());
+        std::vector<std::size_t> end(lines.size());
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < exe.size(); ++i) {
+            if (exe_lines[i] == 0) {
+                continue;
+            } else if (count != 0 && exe_lines[i] == count && exe_lines[i - 1] == count) {
+                end[count - 1] = i;
+            } else if (exe_lines[i] == count + 1 && count < lines.size()) {
+                start[count] = end[count] = i;
+                ++count;
+            } else {
+                return "line " + std::to_string(exe_lines[i]) + " out of order";
+            }
+        }
+        if (count != lines.size()) {
+            return "lines missing";
+        }
+
+        auto decode = [&](std::size_t i) { return exasm::DecodedInst::decode(exe[i].encode()); };
+        auto branch_dest = [&](std::size_t i) {
+            return i + 1 + static_cast<std::int8_t>(decode(i).imm) / 2;
+        };
+        // Where running from i ends up once past the islands there.
+        auto follow = [&](std::size_t i) -> std::optional<std::size_t> {
+            for (std::size_t hops = 0; i < exe.size() && exe_lines[i] == 0; ++hops) {
+                if (hops > exe.size() || decode(i).type != exasm::InstType::J ||
+                    i + 1 >= exe.size() || exe_lines[i + 1] != 0 ||
+                    decode(i + 1).type != exasm::InstType::NOP) {
+                    return std::nullopt;
+                }
+                i = branch_dest(i);
+            }
+            return i;
+        };
+        for (std::size_t l = 0; l < lines.size(); ++l) {
+            std::string at = "line " + std::to_string(l + 1);
+            if (end[l] - start[l] != (lines[l].kind == Kind::LI ? 1u : 0u)) {
+                return at + " split";
+            }
+            if (lines[l].kind == Kind::BRANCH || lines[l].kind == Kind::JUMP) {
+                if (start[l + 1] != start[l] + 1) {
+                    return at + " parted from its delay slot";
+                }
+                if (follow(branch_dest(start[l])) != start[lines[l].target]) {
+                    return at + " doesn't reach line " + std::to_string(lines[l].target + 1);
+                }
+            } else if (l + 1 < lines.size() &&
+                       !(lines[l].kind == Kind::DELAY_SLOT && lines[l - 1].kind == Kind::JUMP) &&
+                       follow(end[l] + 1) != start[l + 1]) {
+                return at + " doesn't run into the next line";
+            }
+        }
+        return std::nullopt;
+    }
+} // namespace
+
+int main(int argc, char **argv) {
+    // Links programs generated from each seed below SEEDS, which have
+    // branches too far for their offsets, and checks that every branch
+    // still gets where it should and code still runs from line to line.
+    if (argc < 5) {
+        std::cerr << "usage: exasm_long_jump_test SEEDS INSTS BRANCH_PERMILLE SPAN\n";
+        return 1;
+    }
+    std::uint32_t seeds = static_cast<std::uint32_t>(std::strtoul(argv[1], nullptr, 10));
+    std::size_t insts = std::strtoul(argv[2], nullptr, 10);
+    std::uint32_t branch_permille = static_cast<std::uint32_t>(std::strtoul(argv[3], nullptr, 10));
+    std::size_t span = std::strtoul(argv[4], nullptr, 10);
+
+    for (std::uint32_t seed = 0; seed < seeds; ++seed) {
+        std::vector<Line> lines = generate(seed, insts, branch_permille, span);
+        std::string source = write_source(lines);
+        exasm::AsmReader reader(source);
+        std::optional<std::string> error;
+        try {
+            exasm::RawAsm raw_asm = reader.read_all();
+            std::vector<exasm::Inst> exe = raw_asm.get_executable();
+            error = check(lines, exe, raw_asm.get_debug_info());
+        } catch (const exasm::ParseError &e) {
+            error = e.what();
+        } catch (const exasm::LinkError &e) {
+            error = e.what();
+        }
+        if (error) {
+            std::cerr << "seed " << seed << ": " << *error << '\n';
+            return 1;
+        }
+    }
+}
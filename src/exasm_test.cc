@@ -1,35 +1,74 @@
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <istream>
 #include <sstream>
 
 #include "asmio.h"
+#include "mapped_file.h"
 
 int main(int argc, char **argv) {
+    // With --debug-info, each line also shows the symbol and the source line
+    // the instruction resolves to. With --long-jumps, the program is followed
+    // by what routing branches through trampolines cost. --fill-delay-slots
+    // links with delay slots filled.
+    bool debug_info = false;
+    bool long_jumps = false;
+    bool fill_delay_slots = false;
+    for (; argc > 1; --argc, ++argv) {
+        if (std::strcmp(argv[1], "--debug-info") == 0) {
+            debug_info = true;
+        } else if (std::strcmp(argv[1], "--long-jumps") == 0) {
+            long_jumps = true;
+        } else if (std::strcmp(argv[1], "--fill-delay-slots") == 0) {
+            fill_delay_slots = true;
+        } else {
+            break;
+        }
+    }
     if (argc < 3) {
-        std::cerr << "usage: exasm_test SOURCE EXPECTS\n";
+        std::cerr << "usage: exasm_test [--debug-info] [--long-jumps] [--fill-delay-slots]"
+                     " SOURCE EXPECTS\n";
         return 1;
     }
 
-    std::ifstream in(argv[1]);
+    exasm::MappedFile in(argv[1]);
     if (!in) {
         std::cerr << "Can't open source file.\n";
         return 1;
     }
-    exasm::AsmReader reader(in);
+    exasm::AsmReader reader(in.view());
     std::stringstream out;
     std::uint16_t addr = 0;
     try {
         exasm::RawAsm raw_asm = reader.read_all();
+        raw_asm.set_fill_delay_slots(fill_delay_slots);
         for (exasm::Inst &i : raw_asm.get_executable()) {
             exasm::write_addr(out, addr) << ' ';
             i.print_bin(out);
             out << " // ";
             i.print_asm(out);
+            if (debug_info) {
+                out << " // ";
+                raw_asm.get_debug_info().write_symbol(out, addr)
+                    << " line " << raw_asm.get_debug_info().find_line(addr);
+            }
             out << '\n';
             addr += 2;
         }
+        if (long_jumps) {
+            const exasm::LongJumpReport &report = raw_asm.get_long_jumps();
+            for (const exasm::LongJumpReport::Site &site : report.sites) {
+                out << "// ";
+                exasm::write_addr(out, site.addr) << " -> ";
+                exasm::write_addr(out, site.dest)
+                    << ": hops " << site.hops << ", cycles +" << 2 * site.hops << ", insts "
+                    << site.own_insts << " own + " << site.shared_insts << " shared\n";
+            }
+            out << "// inserted insts " << report.inserted_insts << ", skipping islands "
+                << report.skip_insts << '\n';
+        }
     } catch (const exasm::ParseError &e) {
         std::cerr << e.what() << '\n';
         return 1;
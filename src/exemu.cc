@@ -1,14 +1,17 @@
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <vector>
 
 #include "asmio.h"
 #include "emulator.h"
+#include "mapped_file.h"
 
 namespace {
-    void pretty_print_mem(const std::array<std::uint8_t, 0x10000> &mem, int start = 0,
-                          int end = 0x10000) {
+    void pretty_print_mem(const exasm::PagedMemory &mem, int start = 0, int end = 0x10000) {
         start &= ~0x7;
         end &= ~0x7;
         for (int i = start; i < end; ++i) {
@@ -23,53 +26,249 @@ namespace {
         std::puts("");
     }
 
+    // Writes addr and the symbol it belongs to, if any.
+    std::ostream &write_location(std::ostream &out, const exasm::DebugInfo &debug_info,
+                                 std::uint16_t addr) {
+        exasm::write_addr(out, addr);
+        if (debug_info.find_symbol(addr) != nullptr) {
+            debug_info.write_symbol(out << " <", addr) << '>';
+        }
+        return out;
+    }
+
+    void print_profile(const exasm::Emulator &emu, const exasm::DebugInfo &debug_info) {
+        const exasm::Profile &profile = *emu.get_profile();
+        std::cout << "cycles: " << emu.get_clock_count() << '\n';
+
+        std::vector<std::size_t> types;
+        for (std::size_t i = 0; i < profile.inst_counts.size(); ++i) {
+            if (profile.inst_counts[i] != 0) {
+                types.push_back(i);
+            }
+        }
+        std::stable_sort(types.begin(), types.end(), [&](std::size_t a, std::size_t b) {
+            return profile.inst_counts[a] > profile.inst_counts[b];
+        });
+        std::cout << "instructions:\n";
+        for (std::size_t i : types) {
+            std::cout << "    " << static_cast<exasm::InstType>(i) << ' '
+                      << profile.inst_counts[i] << '\n';
+        }
+
+        std::vector<std::uint16_t> addrs;
+        for (std::size_t i = 0; i < 0x10000; ++i) {
+            if (profile.pc_counts[i] != 0) {
+                addrs.push_back(i);
+            }
+        }
+        std::stable_sort(addrs.begin(), addrs.end(), [&](std::uint16_t a, std::uint16_t b) {
+            return profile.pc_counts[a] > profile.pc_counts[b];
+        });
+        if (addrs.size() > 20) {
+            addrs.resize(20);
+        }
+        std::cout << "hot addresses:\n";
+        for (std::uint16_t addr : addrs) {
+            std::uint16_t bin = (emu.get_memory()[addr] << 8) | emu.get_memory()[addr + 1];
+            std::cout << "    ";
+            write_location(std::cout, debug_info, addr) << ' ' << profile.pc_counts[addr] << " // ";
+            exasm::Inst::decode(bin).print_asm(std::cout);
+            std::cout << '\n';
+        }
+
+        std::cout << "branches:\n";
+        for (std::size_t i = 0; i < 0x10000; ++i) {
+            if (profile.branch_taken[i] == 0 && profile.branch_not_taken[i] == 0) {
+                continue;
+            }
+            std::cout << "    ";
+            write_location(std::cout, debug_info, i)
+                << " taken " << profile.branch_taken[i] << " not taken "
+                << profile.branch_not_taken[i] << '\n';
+        }
+    }
+
+    void print_pipeline(const exasm::PipelineModel &pipeline, const exasm::DebugInfo &debug_info) {
+        static const char *const reason_names[] = {"raw", "load-use", "branch", "cache-miss"};
+        std::cout << "pipeline cycles: " << pipeline.get_cycle_count() << '\n';
+        std::cout << "stalls:";
+        for (std::size_t r = 0; r < exasm::n_stall_reasons; ++r) {
+            std::cout << ' ' << reason_names[r] << ' '
+                      << pipeline.get_stall_count(static_cast<exasm::StallReason>(r));
+        }
+        std::cout << '\n';
+        for (std::size_t i = 0; i < 0x10000; ++i) {
+            bool stalled = false;
+            for (std::size_t r = 0; r < exasm::n_stall_reasons; ++r) {
+                if (pipeline.get_stall_count(i, static_cast<exasm::StallReason>(r)) != 0) {
+                    stalled = true;
+                }
+            }
+            if (!stalled) {
+                continue;
+            }
+            std::cout << "    ";
+            write_location(std::cout, debug_info, i);
+            for (std::size_t r = 0; r < exasm::n_stall_reasons; ++r) {
+                std::cout << ' ' << reason_names[r] << ' '
+                          << pipeline.get_stall_count(i, static_cast<exasm::StallReason>(r));
+            }
+            std::cout << '\n';
+        }
+    }
+
+    void print_cache(const exasm::CacheModel &cache, const exasm::DebugInfo &debug_info) {
+        std::cout << "data cache: hits " << cache.get_hit_count() << " misses "
+                  << cache.get_miss_count() << " writebacks " << cache.get_writeback_count()
+                  << '\n';
+        std::cout << "by instruction:\n";
+        for (std::size_t i = 0; i < 0x10000; ++i) {
+            if (cache.get_pc_hits()[i] != 0 || cache.get_pc_misses()[i] != 0) {
+                std::cout << "    ";
+                write_location(std::cout, debug_info, i)
+                    << " hits " << cache.get_pc_hits()[i] << " misses "
+                    << cache.get_pc_misses()[i] << '\n';
+            }
+        }
+        std::cout << "by region:\n";
+        for (std::size_t i = 0; i < exasm::CacheModel::n_regions; ++i) {
+            if (cache.get_region_hits()[i] != 0 || cache.get_region_misses()[i] != 0) {
+                std::cout << "    ";
+                exasm::write_addr(std::cout, i << exasm::CacheModel::region_bits)
+                    << " hits " << cache.get_region_hits()[i] << " misses "
+                    << cache.get_region_misses()[i] << '\n';
+            }
+        }
+    }
+
     void pretty_print_reg(const std::array<std::uint16_t, 8> &reg) {
         for (int i = 0; i < 8; ++i) {
             std::printf(" r%d=%04x", i, reg[i]);
         }
         std::puts("");
     }
+
+    template <class Features>
+    bool load_program(exasm::BasicEmulator<Features> &emu, const char *memfile,
+                      const char *progfile, exasm::DebugInfo &debug_info) {
+        std::ifstream memin(memfile);
+        if (!memin) {
+            std::cerr << "Can't open memfile\n";
+            return false;
+        }
+        emu.load_memfile(memin);
+        std::cout << "memfile loaded.\n";
+
+        exasm::MappedFile progin(progfile);
+        if (!progin) {
+            std::cerr << "Can't open prog\n";
+            return false;
+        }
+        exasm::AsmReader reader(progin.view());
+        std::vector<exasm::Inst> prog;
+        try {
+            exasm::RawAsm raw_asm = reader.read_all();
+            prog = raw_asm.get_executable();
+            debug_info = raw_asm.get_debug_info();
+        } catch (const exasm::ParseError &e) {
+            std::cout << e.what() << '\n';
+            return false;
+        } catch (const exasm::LinkError &e) {
+            std::cout << e.what() << '\n';
+            return false;
+        }
+        std::cout << "program loaded.\n";
+
+        emu.set_program(std::move(prog));
+
+        pretty_print_reg(emu.get_register());
+        pretty_print_mem(emu.get_memory(), 0x34, 0x40);
+        return true;
+    }
+
+    // Runs until the program halts or fails, or for max_cycles, then prints
+    // the final state. Returns whether it stopped by itself without failing.
+    template <class Features>
+    bool run_to_end(exasm::BasicEmulator<Features> &emu, std::uint64_t max_cycles) {
+        emu.set_enable_trap(false);
+        exasm::RunStatus status = exasm::RunStatus::CYCLE_LIMIT;
+        while (status == exasm::RunStatus::CYCLE_LIMIT && emu.get_clock_count() < max_cycles) {
+            status = emu.run(std::min<std::uint64_t>(1 << 20, max_cycles - emu.get_clock_count()));
+        }
+        if (status == exasm::RunStatus::ERROR) {
+            std::cout << emu.get_last_error() << '\n';
+        } else if (status == exasm::RunStatus::CYCLE_LIMIT) {
+            std::cout << "cycle limit reached\n";
+        }
+        pretty_print_reg(emu.get_register());
+        pretty_print_mem(emu.get_memory(), 0x34, 0x40);
+        return status != exasm::RunStatus::ERROR && status != exasm::RunStatus::CYCLE_LIMIT;
+    }
 } // namespace
 
 int main(int argc, char **argv) {
+    // With --profile, run the program until it stops and report where the
+    // cycles went, including stalls on the default pipeline and data cache
+    // models, instead of stepping on each line of input. --batch also runs it
+    // until it stops, on an emulator without any of the debugging features,
+    // and only prints the final state. --validate runs it to the end as well,
+    // checking each cycle of the execution engine against the reference
+    // interpreter. These give up after --max-cycles cycles, so that a program
+    // that never stops still ends.
+    bool profile = false;
+    bool batch = false;
+    bool validate = false;
+    std::uint64_t max_cycles = 1 << 24;
+    for (; argc > 1; --argc, ++argv) {
+        if (std::strcmp(argv[1], "--profile") == 0) {
+            profile = true;
+        } else if (std::strcmp(argv[1], "--batch") == 0) {
+            batch = true;
+        } else if (std::strcmp(argv[1], "--validate") == 0) {
+            validate = true;
+        } else if (std::strcmp(argv[1], "--max-cycles") == 0 && argc > 2) {
+            max_cycles = std::strtoull(argv[2], nullptr, 0);
+            --argc;
+            ++argv;
+        } else {
+            break;
+        }
+    }
     if (argc < 3) {
-        std::cout << "usage: exemu memfile prog\n";
+        std::cout << "usage: exemu [--profile | --batch | --validate] [--max-cycles N]"
+                     " memfile prog\n";
         return 1;
     }
 
-    exasm::Emulator emu;
-
-    std::ifstream memin(argv[1]);
-    if (!memin) {
-        std::cerr << "Can't open memfile\n";
-        return 1;
+    exasm::DebugInfo debug_info;
+    if (batch) {
+        exasm::BatchEmulator emu;
+        if (!load_program(emu, argv[1], argv[2], debug_info)) {
+            return 1;
+        }
+        return run_to_end(emu, max_cycles) ? 0 : 1;
     }
-    emu.load_memfile(memin);
-    std::cout << "memfile loaded.\n";
 
-    std::ifstream progin(argv[2]);
-    if (!progin) {
-        std::cerr << "Can't open prog\n";
-        return 1;
-    }
-    exasm::AsmReader reader(progin);
-    std::vector<exasm::Inst> prog;
-    try {
-        exasm::RawAsm raw_asm = reader.read_all();
-        prog = raw_asm.get_executable();
-    } catch (const exasm::ParseError &e) {
-        std::cout << e.what() << '\n';
-        return 1;
-    } catch (const exasm::LinkError &e) {
-        std::cout << e.what() << '\n';
+    exasm::Emulator emu;
+    if (!load_program(emu, argv[1], argv[2], debug_info)) {
         return 1;
     }
-    std::cout << "program loaded.\n";
 
-    emu.set_program(std::move(prog));
+    if (validate) {
+        emu.set_enable_validation(true);
+        return run_to_end(emu, max_cycles) ? 0 : 1;
+    }
 
-    pretty_print_reg(emu.get_register());
-    pretty_print_mem(emu.get_memory(), 0x34, 0x40);
+    if (profile) {
+        emu.set_enable_profile(true);
+        emu.set_enable_pipeline_model(true);
+        emu.set_enable_cache_model(true);
+        bool ended = run_to_end(emu, max_cycles);
+        print_profile(emu, debug_info);
+        print_pipeline(*emu.get_pipeline_model(), debug_info);
+        print_cache(*emu.get_cache_model(), debug_info);
+        return ended ? 0 : 1;
+    }
 
     for (;;) {
         std::string tmp;
@@ -0,0 +1,102 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "asmio.h"
+#include "emulator.h"
+
+namespace {
+    // Adds up and rewrites a table of 64 words, over and over.
+    const char *const program = R"(
+@start lui r5, 0x10
+lli r6, 64
+lli r0, 0
+@loop lw r1, (r5)
+add r0, r1
+addi r1, 3
+and r1, r6
+sw r1, (r5)
+lbu r2, (r5)
+beqz r2, @skip
+addi r5, 2
+sub r0, r2
+@skip addi r6, -1
+bnez r6, @loop
+nop
+j @start
+nop
+)";
+
+    // Runs emu for about cycles cycles and returns how many it ran a second.
+    template <class Features>
+    double measure(exasm::BasicEmulator<Features> &emu, const std::vector<exasm::Inst> &prog,
+                   std::uint64_t cycles, bool use_clock) {
+        emu.set_program(prog);
+        auto start = std::chrono::steady_clock::now();
+        if (use_clock) {
+            for (std::uint64_t i = 0; i < cycles; ++i) {
+                emu.clock();
+            }
+        } else if (emu.run(cycles) != exasm::RunStatus::CYCLE_LIMIT) {
+            std::cerr << "The benchmark stopped early: " << emu.get_last_error() << '\n';
+            std::exit(1);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return static_cast<double>(emu.get_clock_count()) / elapsed.count();
+    }
+
+    template <class Features>
+    void run_all(const char *name, const std::vector<exasm::Inst> &prog, std::uint64_t cycles) {
+        double base = 0;
+        auto report = [&](const char *engine, double rate) {
+            if (base == 0) {
+                base = rate;
+            }
+            std::printf("%-14s %-30s %8.1f Mcycles/s %5.2fx\n", name, engine, rate / 1e6,
+                        rate / base);
+        };
+        {
+            exasm::BasicEmulator<Features> emu;
+            report("clock()", measure(emu, prog, cycles, true));
+        }
+        {
+            exasm::BasicEmulator<Features> emu;
+            emu.set_engine(exasm::ExecEngine::THREADED);
+            report("run() threaded", measure(emu, prog, cycles, false));
+        }
+        {
+            // A watchpoint nothing touches keeps blocks off the lean path.
+            exasm::BasicEmulator<Features> emu;
+            emu.set_mem_watchpoint(0xFFF0, 2, exasm::WatchKind::ACCESS);
+            report("run() block, watchpoint set", measure(emu, prog, cycles, false));
+        }
+        {
+            exasm::BasicEmulator<Features> emu;
+            report("run() block", measure(emu, prog, cycles, false));
+        }
+    }
+} // namespace
+
+int main(int argc, char **argv) {
+    // Times each way of running the same program on both emulators, and
+    // how much faster each one is than calling clock() for every cycle.
+    std::uint64_t cycles = argc > 1 ? std::strtoull(argv[1], nullptr, 0) : 1 << 24;
+
+    exasm::AsmReader reader(program);
+    std::vector<exasm::Inst> prog;
+    try {
+        prog = reader.read_all().get_executable();
+    } catch (const exasm::ParseError &e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    } catch (const exasm::LinkError &e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    run_all<exasm::FullFeatures>("Emulator", prog, cycles);
+    run_all<exasm::BatchFeatures>("BatchEmulator", prog, cycles);
+}
@@ -2,103 +2,403 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "asmio.h"
+#include "cfg.h"
 #include "emulator.h"
+#include "mapped_file.h"
 
-int main(int argc, char **argv) {
-    if (argc < 4) {
-        std::cerr << "usage: exemu_test SOURCE OPERATION EXPECTS\n";
-        return 1;
-    }
-
-    std::ifstream in(argv[1]);
-    if (!in) {
-        std::cerr << "Can't open source file.\n";
-        return 1;
-    }
-    exasm::AsmReader reader(in);
-    exasm::RawAsm prog = reader.read_all();
+namespace {
+    template <class Features>
+    int run_test(const char *source, const char *operation, const char *expects_file,
+                 bool fill_delay_slots) {
+        exasm::MappedFile in(source);
+        if (!in) {
+            std::cerr << "Can't open source file.\n";
+            return 1;
+        }
+        exasm::AsmReader reader(in.view());
+        exasm::RawAsm prog = reader.read_all();
+        prog.set_fill_delay_slots(fill_delay_slots);
 
-    exasm::Emulator emu;
-    emu.set_program(prog.get_executable());
-    emu.set_enable_exec_history(true);
+        std::vector<exasm::Inst> executable = prog.get_executable();
+        exasm::BasicEmulator<Features> emu;
+        emu.set_program(executable);
+        emu.set_enable_exec_history(true);
+        std::vector<exasm::BasicEmulator<Features>> forked_from;
 
-    std::ifstream op(argv[2]);
-    if (!op) {
-        std::cerr << "Can't open operation file.\n";
-        return 1;
-    }
+        std::ifstream op(operation);
+        if (!op) {
+            std::cerr << "Can't open operation file.\n";
+            return 1;
+        }
 
-    for (;;) {
-        std::string current_op;
         for (;;) {
-            std::getline(op, current_op);
-            if (!op) {
-                goto finish;
-            }
-            if (current_op.size() != 0) {
-                break;
+            std::string current_op;
+            for (;;) {
+                std::getline(op, current_op);
+                if (!op) {
+                    goto finish;
+                }
+                if (current_op.size() != 0) {
+                    break;
+                }
             }
-        }
 
-        try {
-            if (current_op == "n") {
-                emu.clock();
-                emu.set_enable_trap(true);
-            } else if (current_op == "rn") {
-                emu.reverse_next_clock();
-            } else if (current_op.substr(0, 2) == "b ") {
-                if (current_op.size() < 3) {
-                    std::cerr << "Address expected for break operation.\n";
-                    return 1;
-                }
-                int addr = std::stoi(current_op.substr(2), nullptr, 0);
-                emu.set_breakpoint(addr);
-            } else if (current_op == "finish") {
-                try {
-                    clock();
-                } catch (const exasm::ExecutionError &e) {
-                    if (std::strcmp(e.what(), "Program finished") == 0) {
-                        break;
-                    }
-                    std::cerr << e.what() << '\n';
+            try {
+                if (current_op == "n") {
+                    emu.clock();
+                    emu.set_enable_trap(true);
+                } else if (current_op == "c") {
+                    // Step over the breakpoint we may be stopped at, then continue.
+                    exasm::RunStatus status = emu.run(1);
+                    emu.set_enable_trap(true);
+                    if (status == exasm::RunStatus::CYCLE_LIMIT) {
+                        status = emu.run(1000000);
+                    }
+                    if (status == exasm::RunStatus::ERROR) {
+                        std::cerr << emu.get_last_error() << '\n';
+                        return 1;
+                    } else if (status == exasm::RunStatus::BREAKPOINT) {
+                        emu.set_enable_trap(false);
+                    }
+                } else if (current_op == "rn") {
+                    emu.reverse_next_clock();
+                } else if (current_op == "rnall") {
+                    // Reverse until the execution history runs out.
+                    for (;;) {
+                        try {
+                            emu.reverse_next_clock();
+                        } catch (const exasm::HistoryExhausted &) {
+                            break;
+                        }
+                    }
+                } else if (current_op == "fork") {
+                    // Continue with a fork; "drop" goes back to the emulator it came from.
+                    exasm::BasicEmulator<Features> child = emu.fork();
+                    forked_from.push_back(std::move(emu));
+                    emu = std::move(child);
+                } else if (current_op == "drop") {
+                    if (forked_from.empty()) {
+                        std::cerr << "Nothing to drop.\n";
+                        return 1;
+                    }
+                    emu = std::move(forked_from.back());
+                    forked_from.pop_back();
+                } else if (current_op == "prof") {
+                    emu.set_enable_profile(true);
+                } else if (current_op.substr(0, 5) == "prof ") {
+                    // prof ADDR N: the instruction at ADDR has run N times
+                    std::istringstream args(current_op.substr(5));
+                    std::string addr, count;
+                    if (!(args >> addr >> count) || emu.get_profile() == nullptr) {
+                        std::cerr << "Usage: prof ADDR COUNT after prof\n";
+                        return 1;
+                    }
+                    std::uint64_t actual =
+                        emu.get_profile()->pc_counts[std::stoi(addr, nullptr, 0)];
+                    if (actual != std::stoull(count, nullptr, 0)) {
+                        std::cerr << "Profile count at " << addr << ": expects " << count
+                                  << ", actual " << actual << '\n';
+                        return 1;
+                    }
+                } else if (current_op == "acc") {
+                    emu.set_enable_mem_access_counts(true);
+                } else if (current_op.substr(0, 4) == "acc ") {
+                    // acc ADDR READS WRITES: the byte at ADDR has been accessed that often
+                    std::istringstream args(current_op.substr(4));
+                    std::string addr, reads, writes;
+                    const exasm::MemAccessCounts *counts = emu.get_mem_access_counts();
+                    if (!(args >> addr >> reads >> writes) || counts == nullptr) {
+                        std::cerr << "Usage: acc ADDR READS WRITES after acc\n";
+                        return 1;
+                    }
+                    int a = std::stoi(addr, nullptr, 0);
+                    if (counts->reads[a] != std::stoul(reads, nullptr, 0) ||
+                        counts->writes[a] != std::stoul(writes, nullptr, 0)) {
+                        std::cerr << "Access counts at " << addr << ": expects " << reads << '/'
+                                  << writes << ", actual " << counts->reads[a] << '/'
+                                  << counts->writes[a] << '\n';
+                        return 1;
+                    }
+                } else if (current_op == "pipe") {
+                    emu.set_enable_pipeline_model(true);
+                } else if (current_op.substr(0, 5) == "pipe ") {
+                    // pipe STAGES FORWARD BRANCH_STAGE, FORWARD is one of
+                    // both, ex, mem and none
+                    std::istringstream args(current_op.substr(5));
+                    exasm::PipelineConfig config;
+                    std::string forward;
+                    if (!(args >> config.n_stages >> forward >> config.branch_stage)) {
+                        std::cerr << "Usage: pipe STAGES FORWARD BRANCH_STAGE\n";
+                        return 1;
+                    }
+                    config.forward_ex = forward == "both" || forward == "ex";
+                    config.forward_mem = forward == "both" || forward == "mem";
+                    emu.set_enable_pipeline_model(true, config);
+                } else if (current_op.substr(0, 7) == "cycles ") {
+                    // cycles N: the pipeline model took N cycles
+                    const exasm::PipelineModel *pipeline = emu.get_pipeline_model();
+                    std::uint64_t expected = std::stoull(current_op.substr(7), nullptr, 0);
+                    if (pipeline == nullptr || pipeline->get_cycle_count() != expected) {
+                        std::cerr << "Pipeline cycles: expects " << expected << ", actual "
+                                  << (pipeline ? pipeline->get_cycle_count() : 0) << '\n';
+                        return 1;
+                    }
+                } else if (current_op.substr(0, 5) == "wcet ") {
+                    // wcet N ADDR=BOUND...: the static bound on the pipeline
+                    // model, with the loops headed at each ADDR bounded
+                    std::istringstream args(current_op.substr(5));
+                    std::uint64_t expected;
+                    args >> expected;
+                    std::map<std::uint16_t, std::uint64_t> bounds;
+                    std::string bound;
+                    while (args >> bound) {
+                        std::size_t eq = bound.find('=');
+                        bounds[std::stoi(bound.substr(0, eq), nullptr, 0)] =
+                            std::stoull(bound.substr(eq + 1), nullptr, 0);
+                    }
+                    const exasm::PipelineModel *pipeline = emu.get_pipeline_model();
+                    exasm::PipelineConfig config;
+                    if (pipeline != nullptr) {
+                        config = pipeline->get_config();
+                    }
+                    exasm::ControlFlowGraph cfg(executable);
+                    std::uint64_t actual = cfg.get_wcet(config, bounds);
+                    if (actual != expected) {
+                        std::cerr << "WCET: expects " << expected << ", actual " << actual << '\n';
+                        return 1;
+                    }
+                } else if (current_op.substr(0, 6) == "stall ") {
+                    // stall ADDR REASON N: the instruction at ADDR stalled N cycles
+                    // for REASON, which is raw, load, branch or cache
+                    std::istringstream args(current_op.substr(6));
+                    std::string addr, reason, count;
+                    const exasm::PipelineModel *pipeline = emu.get_pipeline_model();
+                    if (!(args >> addr >> reason >> count) || pipeline == nullptr ||
+                        (reason != "raw" && reason != "load" && reason != "branch" &&
+                         reason != "cache")) {
+                        std::cerr << "Usage: stall ADDR raw|load|branch|cache COUNT after pipe\n";
+                        return 1;
+                    }
+                    exasm::StallReason r = reason == "raw"      ? exasm::StallReason::RAW
+                                           : reason == "load"   ? exasm::StallReason::LOAD_USE
+                                           : reason == "branch" ? exasm::StallReason::BRANCH
+                                                                : exasm::StallReason::CACHE_MISS;
+                    std::uint64_t actual =
+                        pipeline->get_stall_count(std::stoi(addr, nullptr, 0), r);
+                    if (actual != std::stoull(count, nullptr, 0)) {
+                        std::cerr << "Stalls at " << addr << " for " << reason << ": expects "
+                                  << count << ", actual " << actual << '\n';
+                        return 1;
+                    }
+                } else if (current_op.substr(0, 6) == "cache ") {
+                    // cache SIZE LINE_SIZE WAYS lru|fifo|random wb|wt, where wt
+                    // does not allocate on write misses
+                    std::istringstream args(current_op.substr(6));
+                    exasm::CacheConfig config;
+                    std::string replacement, write;
+                    if (!(args >> config.size >> config.line_size >> config.associativity >>
+                          replacement >> write)) {
+                        std::cerr << "Usage: cache SIZE LINE_SIZE WAYS REPLACEMENT WRITE\n";
+                        return 1;
+                    }
+                    if (replacement == "fifo") {
+                        config.replacement = exasm::ReplacementPolicy::FIFO;
+                    } else if (replacement == "random") {
+                        config.replacement = exasm::ReplacementPolicy::RANDOM;
+                    }
+                    if (write == "wt") {
+                        config.write_policy = exasm::WritePolicy::WRITE_THROUGH;
+                        config.write_allocate = false;
+                    }
+                    emu.set_enable_cache_model(true, config);
+                } else if (current_op.substr(0, 5) == "chit " ||
+                           current_op.substr(0, 8) == "cregion ") {
+                    // chit ADDR HITS MISSES: the instruction at ADDR hit and missed
+                    // that often; cregion REGION HITS MISSES: the same for accesses
+                    // to the 256-byte region
+                    bool by_pc = current_op[1] == 'h';
+                    std::istringstream args(current_op.substr(by_pc ? 5 : 8));
+                    std::string index, hits, misses;
+                    const exasm::CacheModel *cache = emu.get_cache_model();
+                    if (!(args >> index >> hits >> misses) || cache == nullptr) {
+                        std::cerr << "Usage: chit|cregion INDEX HITS MISSES after cache\n";
+                        return 1;
+                    }
+                    int i = std::stoi(index, nullptr, 0);
+                    std::uint64_t actual_hits =
+                        by_pc ? cache->get_pc_hits()[i] : cache->get_region_hits()[i];
+                    std::uint64_t actual_misses =
+                        by_pc ? cache->get_pc_misses()[i] : cache->get_region_misses()[i];
+                    if (actual_hits != std::stoull(hits, nullptr, 0) ||
+                        actual_misses != std::stoull(misses, nullptr, 0)) {
+                        std::cerr << "Cache hits/misses at " << index << ": expects " << hits
+                                  << '/' << misses << ", actual " << actual_hits << '/'
+                                  << actual_misses << '\n';
+                        return 1;
+                    }
+                } else if (current_op == "rc") {
+                    if (!emu.reverse_continue()) {
+                        std::cerr << "No earlier breakpoint hit.\n";
+                        return 1;
+                    }
+                } else if (current_op.substr(0, 5) == "seek ") {
+                    if (emu.seek_to_clock(std::stoull(current_op.substr(5), nullptr, 0)) ==
+                        exasm::RunStatus::ERROR) {
+                        std::cerr << emu.get_last_error() << '\n';
+                        return 1;
+                    }
+                } else if (current_op.substr(0, 5) == "ckpt ") {
+                    emu.set_checkpoint_interval(std::stoull(current_op.substr(5), nullptr, 0));
+                } else if (current_op.substr(0, 5) == "hist ") {
+                    emu.set_exec_history_budget(std::stoi(current_op.substr(5), nullptr, 0));
+                } else if (current_op == "validate") {
+                    emu.set_enable_validation(true);
+                } else if (current_op == "engine threaded") {
+                    emu.set_engine(exasm::ExecEngine::THREADED);
+                } else if (current_op == "engine block") {
+                    emu.set_engine(exasm::ExecEngine::BLOCK);
+                } else if (current_op == "widx") {
+                    emu.set_enable_write_index(true);
+                } else if (current_op.substr(0, 6) == "lastw ") {
+                    // lastw LOC CLOCK PC: the last write to LOC, an address or
+                    // rN, is seen from cycle CLOCK and was made at PC
+                    // lastw LOC none: no write to LOC is indexed
+                    std::istringstream args(current_op.substr(6));
+                    std::string loc, clock, pc;
+                    if (!(args >> loc >> clock) || (clock != "none" && !(args >> pc))) {
+                        std::cerr << "Usage: lastw LOC CLOCK PC | lastw LOC none\n";
+                        return 1;
+                    }
+                    std::optional<exasm::WriteRecord> write;
+                    if (loc.size() == 2 && loc[0] == 'r') {
+                        write = emu.find_last_reg_write(loc[1] - '0');
+                    } else {
+                        write = emu.find_last_mem_write(std::stoi(loc, nullptr, 0));
+                    }
+                    bool ok = clock == "none"
+                                  ? !write
+                                  : write && write->clock == std::stoull(clock, nullptr, 0) &&
+                                        write->pc == std::stoi(pc, nullptr, 0);
+                    if (!ok) {
+                        std::cerr << "Last write to " << loc << ": expects " << clock << ' '
+                                  << pc << ", actual ";
+                        if (write) {
+                            std::cerr << write->clock << ' ' << write->pc << '\n';
+                        } else {
+                            std::cerr << "none\n";
+                        }
+                        return 1;
+                    }
+                } else if (current_op.substr(0, 2) == "b ") {
+                    if (current_op.size() < 3) {
+                        std::cerr << "Address expected for break operation.\n";
+                        return 1;
+                    }
+                    int addr = std::stoi(current_op.substr(2), nullptr, 0);
+                    emu.set_breakpoint(addr);
+                } else if (current_op.substr(0, 4) == "bif ") {
+                    // bif ADDR rN VALUE: break at ADDR when rN == VALUE
+                    std::istringstream args(current_op.substr(4));
+                    std::string addr, regname, val;
+                    if (!(args >> addr >> regname >> val) || regname.size() != 2 ||
+                        regname[0] != 'r') {
+                        std::cerr << "Usage: bif ADDR rN VALUE\n";
+                        return 1;
+                    }
+                    exasm::BreakCondition cond{
+                        exasm::CondOperand::REG, static_cast<std::uint16_t>(regname[1] - '0'),
+                        exasm::CondOp::EQ, static_cast<std::uint16_t>(std::stoi(val, nullptr, 0))};
+                    emu.set_breakpoint(std::stoi(addr, nullptr, 0), cond);
+                } else if (current_op.substr(0, 2) == "w ") {
+                    if (current_op.size() < 3) {
+                        std::cerr << "Address expected for watch operation.\n";
+                        return 1;
+                    }
+                    int addr = std::stoi(current_op.substr(2), nullptr, 0);
+                    emu.set_mem_watchpoint(addr, 1, exasm::WatchKind::WRITE);
+                } else if (current_op == "finish") {
+                    try {
+                        clock();
+                    } catch (const exasm::ExecutionError &e) {
+                        if (std::strcmp(e.what(), "Program finished") == 0) {
+                            break;
+                        }
+                        std::cerr << e.what() << '\n';
+                        return 1;
+                    }
+                } else {
+                    std::cerr << "Invalid operation: " << current_op << '\n';
                     return 1;
                 }
-            } else {
-                std::cerr << "Invalid operation: " << current_op << '\n';
+            } catch (const exasm::ExecutionError &e) {
+                std::cerr << e.what() << '\n';
+                return 1;
+            } catch (const exasm::AnalysisError &e) {
+                std::cerr << e.what() << '\n';
+                return 1;
+            } catch (const exasm::HistoryExhausted &e) {
+                std::cerr << e.what() << '\n';
                 return 1;
+            } catch (const exasm::Breakpoint &) {
+                emu.set_enable_trap(false);
             }
-        } catch (const exasm::ExecutionError &e) {
-            std::cerr << e.what() << '\n';
+        }
+    finish:
+
+        std::ifstream expects(expects_file);
+        if (!expects) {
+            std::cerr << "Can't open expects file.\n";
             return 1;
-        } catch (const exasm::Breakpoint &) {
-            emu.set_enable_trap(false);
         }
+        for (int i = 0;; ++i) {
+            std::string e;
+            if (!std::getline(expects, e)) {
+                break;
+            }
+            unsigned int ev = std::stoi(e, nullptr, 0);
+            unsigned int av = emu.get_memory()[0x100 + i];
+            if (ev != av) {
+                std::cerr << "Assertion failed:\n";
+                std::cerr << "    expects:\n";
+                std::cerr << "        " << ev << " (" << e << ")\n";
+                std::cerr << "    actual:\n";
+                std::cerr << "        " << av << '\n';
+                return 1;
+            }
+        }
+        return 0;
     }
-finish:
+} // namespace
 
-    std::ifstream expects(argv[3]);
-    if (!expects) {
-        std::cerr << "Can't open expects file.\n";
-        return 1;
-    }
-    for (int i = 0;; ++i) {
-        std::string e;
-        if (!std::getline(expects, e)) {
+int main(int argc, char **argv) {
+    // With --batch, the test runs on a BatchEmulator, which ignores
+    // breakpoints and has no time travel. With --fill-delay-slots, the
+    // program is linked with delay slots filled.
+    bool batch = false;
+    bool fill_delay_slots = false;
+    for (; argc > 1; --argc, ++argv) {
+        if (std::strcmp(argv[1], "--batch") == 0) {
+            batch = true;
+        } else if (std::strcmp(argv[1], "--fill-delay-slots") == 0) {
+            fill_delay_slots = true;
+        } else {
             break;
         }
-        unsigned int ev = std::stoi(e, nullptr, 0);
-        unsigned int av = emu.get_memory()[0x100 + i];
-        if (ev != av) {
-            std::cerr << "Assertion failed:\n";
-            std::cerr << "    expects:\n";
-            std::cerr << "        " << ev << " (" << e << ")\n";
-            std::cerr << "    actual:\n";
-            std::cerr << "        " << av << '\n';
-            return 1;
-        }
     }
+    if (argc < 4) {
+        std::cerr << "usage: exemu_test [--batch] [--fill-delay-slots] SOURCE OPERATION EXPECTS\n";
+        return 1;
+    }
+
+    if (batch) {
+        return run_test<exasm::BatchFeatures>(argv[1], argv[2], argv[3], fill_delay_slots);
+    }
+    return run_test<exasm::FullFeatures>(argv[1], argv[2], argv[3], fill_delay_slots);
 }
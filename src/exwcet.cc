@@ -0,0 +1,96 @@
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "asmio.h"
+#include "cfg.h"
+#include "mapped_file.h"
+
+namespace {
+    void print_cfg(const exasm::ControlFlowGraph &cfg, const exasm::PipelineConfig &config) {
+        const std::vector<exasm::BasicBlock> &blocks = cfg.get_blocks();
+        std::cout << "blocks:\n";
+        for (std::size_t b = 0; b < blocks.size(); ++b) {
+            std::cout << "    ";
+            exasm::write_addr(std::cout, blocks[b].start)
+                << " insts " << blocks[b].insts.size() << " cycles "
+                << cfg.get_block_cycles(config, b);
+            if (blocks[b].halts) {
+                std::cout << " halts";
+            } else if (blocks[b].succs.empty()) {
+                std::cout << " exits";
+            }
+            for (const exasm::CfgEdge &e : blocks[b].succs) {
+                std::cout << (e.taken ? " taken " : " next ");
+                exasm::write_addr(std::cout, blocks[e.to].start);
+            }
+            std::cout << '\n';
+        }
+
+        std::cout << "loops:\n";
+        for (const exasm::CfgLoop &loop : cfg.get_loops()) {
+            std::cout << "    ";
+            exasm::write_addr(std::cout, blocks[loop.header].start) << ':';
+            for (std::size_t b : loop.body) {
+                std::cout << ' ';
+                exasm::write_addr(std::cout, blocks[b].start);
+            }
+            std::cout << '\n';
+        }
+    }
+} // namespace
+
+int main(int argc, char **argv) {
+    // Each --bound ADDR=N says the loop headed at ADDR runs its header at
+    // most N times each time it is entered.
+    std::map<std::uint16_t, std::uint64_t> bounds;
+    int argi = 1;
+    while (argi + 1 < argc && std::strcmp(argv[argi], "--bound") == 0) {
+        std::string bound = argv[argi + 1];
+        std::size_t eq = bound.find('=');
+        try {
+            bounds[std::stoi(bound.substr(0, eq), nullptr, 0)] =
+                std::stoull(bound.substr(eq + 1), nullptr, 0);
+        } catch (const std::exception &) {
+            std::cerr << "Invalid bound: " << bound << '\n';
+            return 1;
+        }
+        argi += 2;
+    }
+    if (argi + 1 != argc) {
+        std::cout << "usage: wcet [--bound ADDR=N]... prog\n";
+        return 1;
+    }
+
+    exasm::MappedFile progin(argv[argi]);
+    if (!progin) {
+        std::cerr << "Can't open prog\n";
+        return 1;
+    }
+    exasm::AsmReader reader(progin.view());
+    std::vector<exasm::Inst> prog;
+    try {
+        exasm::RawAsm raw_asm = reader.read_all();
+        prog = raw_asm.get_executable();
+    } catch (const exasm::ParseError &e) {
+        std::cout << e.what() << '\n';
+        return 1;
+    } catch (const exasm::LinkError &e) {
+        std::cout << e.what() << '\n';
+        return 1;
+    }
+
+    exasm::PipelineConfig config;
+    try {
+        exasm::ControlFlowGraph cfg(prog);
+        print_cfg(cfg, config);
+        std::uint64_t cycles = cfg.get_wcet(config, bounds);
+        std::cout << "worst case cycles: " << cycles << '\n';
+    } catch (const exasm::AnalysisError &e) {
+        std::cout << e.what() << '\n';
+        return 1;
+    }
+}
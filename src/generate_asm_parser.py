@@ -41,10 +41,13 @@ if __name__ == '__main__':
                     out.write('    must_read(\')\', "before address register");\n')
                 elif inst['args'][i] == 'baddr':
                     write_line_directive(out, currentframe())
-                    out.write('    std::string imm_label = maybe_read_label();\n')
-                    out.write('    if (imm_label.empty()) {\n')
+                    out.write('    std::string_view imm_name = maybe_read_label();\n')
+                    out.write('    SymbolId imm_label;\n')
+                    out.write('    if (imm_name.empty()) {\n')
                     out.write('        std::uint8_t baddr = read_immediate<std::uint8_t>(true);\n')
                     out.write('        imm_label = to.add_auto_label(static_cast<std::int8_t>(baddr));\n')
+                    out.write('    } else {\n')
+                    out.write('        imm_label = to.get_symbol(imm_name);\n')
                     out.write('    }\n')
                     out.write('    \n')
                     pass
@@ -1,31 +1,22 @@
-from inspect import currentframe
 import sys
 from inst_reader import *
-from metadata import *
 
-def write_reg_type(out, insts):
-    out.write('    InstType type;\n')
-    out.write('    switch (inst & 0xF) {\n')
-    for inst in insts:
-        out.write('    case 0b{}:\n'.format(inst['opcode']))
-        out.write('        type = InstType::{};\n'.format(inst['name'].upper()))
-        out.write('        break;\n')
-    out.write('    default:\n')
-    out.write('        return Inst::new_with_data(inst);\n')
-    out.write('    }\n')
-    out.write('    return new_with_reg_reg(type, static_cast<std::uint8_t>((inst >> 8) & 0x7), static_cast<std::uint8_t>((inst >> 5) & 0x7));\n')
+# Emits the definition of decode_table: the DecodedInst for every one of the
+# 65536 encodings, so that decoding is a single indexed load. Encodings that
+# are not an instruction are marked as raw words.
 
-def write_imm_type(out, insts):
-    out.write('    InstType type;\n')
-    out.write('    switch ((inst >> 11) & 0xF) {\n')
-    for inst in insts:
-        out.write('    case 0b{}:\n'.format(inst['opcode']))
-        out.write('        type = InstType::{};\n'.format(inst['name'].upper()))
-        out.write('        break;\n')
-    out.write('    default:\n')
-    out.write('        return Inst::new_with_data(inst);\n')
-    out.write('    }\n')
-    out.write('    return new_with_reg_imm(type, static_cast<std::uint8_t>((inst >> 8) & 0x7), static_cast<std::uint8_t>(inst  & 0xFF));\n')
+def decode(word, by_opcode):
+    if (word >> 11) == 0:
+        kind = 'mem' if ((word >> 4) & 1) == 1 else 'reg_arith'
+        inst = by_opcode.get((kind, word & 0xF))
+        if inst is None:
+            return None
+        return (inst['name'].upper(), (word >> 8) & 0x7, (word >> 5) & 0x7, 0, False)
+    kind = 'branch' if ((word >> 15) & 1) == 1 else 'imm'
+    inst = by_opcode.get((kind, (word >> 11) & 0xF))
+    if inst is None:
+        return None
+    return (inst['name'].upper(), (word >> 8) & 0x7, 0, word & 0xFF, True)
 
 if __name__ == '__main__':
     if len(sys.argv) < 2:
@@ -33,16 +24,23 @@ if __name__ == '__main__':
         sys.exit(1)
 
     insts = read_insts(sys.argv[1:-1])
+    by_opcode = {}
+    for inst in insts:
+        by_opcode[(inst['type'], int(inst['opcode'], 2))] = inst
 
     with open(sys.argv[-1], 'w') as out:
-        out.write('if ((inst >> 11) == 0 && ((inst >> 4) & 1) == 0) {\n')
-        write_reg_type(out, filter(lambda x: x['type'] == 'reg_arith', insts));
-        out.write('} else if ((inst >> 11) == 0 && ((inst >> 4) & 1) == 1) {\n')
-        write_reg_type(out, filter(lambda x: x['type'] == 'mem', insts));
-        out.write('} else if (((inst >> 15) & 1) == 0) {\n')
-        write_imm_type(out, filter(lambda x: x['type'] == 'imm', insts));
-        out.write('} else if (((inst >> 15) & 1) == 1) {\n')
-        write_imm_type(out, filter(lambda x: x['type'] == 'branch', insts));
-        out.write('}\n')
-        out.write('return new_with_data(inst);\n')
-
+        out.write('#define EXASM_I(type, rd, rs, imm, has_imm) '
+                  'DecodedInst{InstType::type, rd, rs, imm, false, has_imm}\n')
+        out.write('#define EXASM_D DecodedInst{InstType{}, 0, 0, 0, true, false}\n')
+        out.write('constexpr std::array<DecodedInst, 0x10000> decode_table = {{\n')
+        for word in range(0x10000):
+            decoded = decode(word, by_opcode)
+            if decoded is None:
+                out.write('EXASM_D,\n')
+            else:
+                out.write('EXASM_I({}, {}, {}, {}, {}),\n'.format(
+                    decoded[0], decoded[1], decoded[2], decoded[3],
+                    'true' if decoded[4] else 'false'))
+        out.write('}};\n')
+        out.write('#undef EXASM_I\n')
+        out.write('#undef EXASM_D\n')
@@ -1,6 +1,38 @@
 import sys
 from inst_reader import *
 
+def translate_action(action):
+    return action \
+        .replace('uword', 'static_cast<std::uint16_t>') \
+        .replace('sword', 'sign_extend') \
+        .replace('ubyte', 'static_cast<std::uint8_t>') \
+        .replace('sbyte', 'static_cast<std::int8_t>') \
+        .replace('rd', 'inst.rd') \
+        .replace('rs', 'inst.rs') \
+        .replace('setreg', 'transaction.set_register') \
+        .replace('setmem', 'transaction.set_memory') \
+        .replace('imm', 'inst.imm') \
+        .replace('addr', 'reg[inst.rs]') \
+        .replace('setstate', 'transaction.set_priv_state') \
+        .replace('getstate', 'get_priv_state') \
+        .replace('throw ExecutionError', 'return fail') \
+        .replace('getmem(', 'load_memory(exec_addr, ')
+
+def write_inst_body(out, inst):
+    code = translate_action(inst['action'])
+
+    if 'word_align' in inst and inst['word_align']:
+        out.write('    if (Features::alignment_checks && reg[inst.rs] % 2 != 0) {\n')
+        out.write('        return fail("Addess is not well aligned");\n')
+        out.write('    }\n')
+
+    if inst['type'] == 'branch':
+        out.write(f'    if ({code}) ''{\n')
+        out.write('        transaction.branch_to(exec_addr + 2 + sign_extend(inst.imm));\n')
+        out.write('    }\n')
+    else:
+        out.write('    %s;\n'%(code))
+
 if __name__ == '__main__':
     if len(sys.argv) < 2:
         print('output file required.')
@@ -11,36 +43,6 @@ if __name__ == '__main__':
     with open(sys.argv[-1], 'w') as out:
         for inst in insts:
             out.write('case InstType::%s: {\n'%(inst['name'].upper()))
-            code = inst['action'] \
-                .replace('uword', 'static_cast<std::uint16_t>') \
-                .replace('sword', 'sign_extend') \
-                .replace('ubyte', 'static_cast<std::uint8_t>') \
-                .replace('sbyte', 'static_cast<std::int8_t>') \
-                .replace('rd', 'inst.rd') \
-                .replace('rs', 'inst.rs') \
-                .replace('setreg', 'set_register') \
-                .replace('setmem', 'set_memory') \
-                .replace('getmem', 'get_memory') \
-                .replace('imm', 'std::get<std::uint8_t>(inst.imm)') \
-                .replace('addr', 'reg[inst.rs]') \
-                .replace('setstate', 'set_priv_state') \
-                .replace('getstate', 'get_priv_state')
-
-            if 'word_align' in inst and inst['word_align']:
-                out.write('    if (reg[inst.rs] % 2 != 0) {\n')
-                out.write('        throw ExecutionError(\n')
-                out.write('            "Addess is not well aligned");\n')
-                out.write('    }\n')
-
-            if inst['type'] == 'branch':
-                out.write(f'    if ({code}) ''{\n')
-                out.write('        transaction.emplace_back([&] {\n')
-                out.write('            branched_pc = exec_addr + 2 + sign_extend(std::get<std::uint8_t>(inst.imm));\n')
-                out.write('            delay_slot_rem = 1;\n')
-                out.write('            is_delay_slot = true;\n')
-                out.write('        });\n')
-                out.write('    }\n')
-            else:
-                out.write('    transaction.emplace_back([&] {%s;});\n'%(code))
+            write_inst_body(out, inst)
             out.write('    break;\n')
             out.write('}\n')
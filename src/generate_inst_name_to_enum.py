@@ -1,5 +1,30 @@
+from inspect import currentframe
 import sys
 from inst_reader import *
+from metadata import *
+
+PSEUDO_INSTS = [('.li', 'PseudoInst::LI'), ('.word', 'PseudoInst::WORD')]
+
+FNV_PRIME = 16777619
+
+# Must match mnemonic_hash() written below.
+def mnemonic_hash(name, seed, mask):
+    h = seed
+    for c in name.encode():
+        h = ((h ^ c) * FNV_PRIME) & 0xffffffff
+    return (h ^ (h >> 15)) & mask
+
+# Finds a table size and a seed with which no two mnemonics share a slot.
+def find_perfect_hash(names):
+    size = 1
+    while size < 2 * len(names):
+        size *= 2
+    while True:
+        for seed in range(1, 1 << 16):
+            slots = {mnemonic_hash(name, seed, size - 1) for name in names}
+            if len(slots) == len(names):
+                return size, seed
+        size *= 2
 
 if __name__ == '__main__':
     if len(sys.argv) < 2:
@@ -7,10 +32,53 @@ if __name__ == '__main__':
         sys.exit(1)
 
     insts = read_insts(sys.argv[1:-1])
+    mnemonics = [(inst['name'], 'InstType::' + inst['name'].upper()) for inst in insts]
+    mnemonics += PSEUDO_INSTS
+    size, seed = find_perfect_hash([name for name, _ in mnemonics])
+    table = [('', 'PseudoInst::PLACEHOLDER')] * size
+    for name, value in mnemonics:
+        table[mnemonic_hash(name, seed, size - 1)] = (name, value)
 
     with open(sys.argv[-1], 'w') as out:
-        out.write('if (inst == "{}") return InstType::{};\n'
-                  .format(insts[0]['name'], insts[0]['name'].upper()))
-        for inst in insts[1:]:
-            out.write('else if (inst == "{}") return InstType::{};\n'
-                      .format(inst['name'], inst['name'].upper()))
+        write_line_directive(out, currentframe())
+        out.write('namespace {\n')
+        out.write('constexpr std::uint32_t mnemonic_hash(std::string_view name) {\n')
+        out.write('    std::uint32_t h = {}u;\n'.format(seed))
+        out.write('    for (char c : name) {\n')
+        out.write('        h = (h ^ static_cast<unsigned char>(c)) * {}u;\n'.format(FNV_PRIME))
+        out.write('    }\n')
+        out.write('    return (h ^ (h >> 15)) & {}u;\n'.format(size - 1))
+        out.write('}\n')
+        out.write('\n')
+        out.write('class MnemonicEntry {\n')
+        out.write('public:\n')
+        out.write('    std::string_view name;\n')
+        out.write('    std::variant<InstType, PseudoInst> type;\n')
+        out.write('};\n')
+        out.write('\n')
+        out.write('// Unused slots have an empty name.\n')
+        out.write('constexpr std::array<MnemonicEntry, {}> mnemonic_table = {{{{\n'.format(size))
+        for name, value in table:
+            out.write('    {{"{}", {}}},\n'.format(name, value))
+        write_line_directive(out, currentframe())
+        out.write('}};\n')
+        out.write('\n')
+        out.write('constexpr bool is_mnemonic_hash_perfect() {\n')
+        out.write('    for (std::size_t i = 0; i < mnemonic_table.size(); ++i) {\n')
+        out.write('        if (!mnemonic_table[i].name.empty() &&\n')
+        out.write('            mnemonic_hash(mnemonic_table[i].name) != i) {\n')
+        out.write('            return false;\n')
+        out.write('        }\n')
+        out.write('    }\n')
+        out.write('    return true;\n')
+        out.write('}\n')
+        out.write('static_assert(is_mnemonic_hash_perfect());\n')
+        out.write('\n')
+        out.write('std::optional<std::variant<InstType, PseudoInst>> find_mnemonic(std::string_view name) {\n')
+        out.write('    const MnemonicEntry &entry = mnemonic_table[mnemonic_hash(name)];\n')
+        out.write('    if (entry.name.empty() || entry.name != name) {\n')
+        out.write('        return std::nullopt;\n')
+        out.write('    }\n')
+        out.write('    return entry.type;\n')
+        out.write('}\n')
+        out.write('} // namespace\n')
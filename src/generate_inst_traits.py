@@ -1,4 +1,5 @@
 from inspect import currentframe
+import re
 import sys
 from inst_reader import *
 from metadata import *
@@ -17,6 +18,40 @@ def write_func_is_inst_branch(out, insts):
     out.write('        false;\n')
     out.write('}\n')
 
+# Register operands are found in the action: reg[rd] or reg[rs] is a read
+# (addr is reg[rs] too), and setreg(rd, ...) is a write.
+def reads_rd(inst):
+    return 'reg[rd]' in inst['action']
+
+def reads_rs(inst):
+    return re.search(r'reg\[rs\]|\baddr\b', inst['action']) is not None
+
+def writes_rd(inst):
+    return re.search(r'setreg\(\s*rd\b', inst['action']) is not None
+
+def write_func_inst_pred(out, insts, name, pred):
+    write_line_directive(out, currentframe())
+    # ty goes unused when no instruction matches.
+    out.write('[[maybe_unused]] bool {}([[maybe_unused]] InstType ty) {{\n'.format(name))
+    out.write('    return\n')
+
+    for inst in insts:
+        if pred(inst):
+            write_line_directive(out, currentframe())
+            out.write('        ty == InstType::{} ||\n'.format(inst['name'].upper()))
+
+    write_line_directive(out, currentframe())
+    out.write('        false;\n')
+    out.write('}\n')
+
+# Raises an exception from its action, or traps on an unaligned word address.
+def may_throw(inst):
+    return 'throw' in inst['action'] or ('word_align' in inst and inst['word_align'])
+
+def write_n_inst_types(out, insts):
+    write_line_directive(out, currentframe())
+    out.write('[[maybe_unused]] constexpr std::size_t n_inst_types = {};\n'.format(len(insts)))
+
 if __name__ == '__main__':
     if len(sys.argv) < 2:
         print('output file required.')
@@ -30,6 +65,19 @@ if __name__ == '__main__':
         out.write('namespace {\n')
 
         write_func_is_inst_branch(out, insts)
+        write_n_inst_types(out, insts)
+        write_func_inst_pred(out, insts, 'inst_reads_rd', reads_rd)
+        write_func_inst_pred(out, insts, 'inst_reads_rs', reads_rs)
+        write_func_inst_pred(out, insts, 'inst_writes_rd', writes_rd)
+        write_func_inst_pred(out, insts, 'is_inst_load', lambda inst: 'getmem' in inst['action'])
+        write_func_inst_pred(out, insts, 'is_inst_jump',
+                             lambda inst: inst['type'] == 'branch' and inst['action'] == 'true')
+        write_func_inst_pred(out, insts, 'is_inst_store', lambda inst: 'setmem' in inst['action'])
+        write_func_inst_pred(out, insts, 'inst_reads_state',
+                             lambda inst: 'getstate' in inst['action'])
+        write_func_inst_pred(out, insts, 'inst_writes_state',
+                             lambda inst: 'setstate' in inst['action'])
+        write_func_inst_pred(out, insts, 'inst_may_throw', may_throw)
 
         write_line_directive(out, currentframe())
         out.write('} // namespace\n')
@@ -0,0 +1,29 @@
+import io
+import sys
+from inst_reader import *
+from generate_executor import write_inst_body
+
+# Emits the cases of the switch in Emulator::run_block_lean(). Writes go
+# straight to the state instead of into the Transaction, since nothing
+# records or checks them there. Actions fail before they write anything,
+# so a failing cycle still changes nothing.
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('output file required.')
+        sys.exit(1)
+
+    insts = read_insts(sys.argv[1:-1])
+
+    with open(sys.argv[-1], 'w') as out:
+        for inst in insts:
+            body = io.StringIO()
+            write_inst_body(body, inst)
+            code = body.getvalue() \
+                .replace('transaction.set_register(', 'set_register_lean(') \
+                .replace('transaction.set_memory(', 'set_memory_lean(') \
+                .replace('transaction.set_priv_state(', 'set_priv_state_lean(')
+            out.write('case InstType::%s: {\n'%(inst['name'].upper()))
+            out.write(code)
+            out.write('    break;\n')
+            out.write('}\n')
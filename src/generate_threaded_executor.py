@@ -0,0 +1,60 @@
+import sys
+from inst_reader import *
+from generate_executor import write_inst_body
+
+# Emits the body of Emulator::run(). The includer defines EXASM_BEGIN_CYCLE()
+# and EXASM_FINISH_CYCLE(), and EXASM_THREADED_DISPATCH if the compiler
+# supports computed goto. With it, every handler ends with its own copy of
+# fetch and dispatch, so each instruction costs one indirect jump. Without
+# it, the same handlers become cases of a switch in a loop.
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('output file required.')
+        sys.exit(1)
+
+    insts = read_insts(sys.argv[1:-1])
+
+    with open(sys.argv[-1], 'w') as out:
+        out.write('#ifdef EXASM_THREADED_DISPATCH\n')
+        out.write('#pragma GCC diagnostic push\n')
+        out.write('#pragma GCC diagnostic ignored "-Wpedantic"\n')
+        out.write('static void *const dispatch_table[] = {\n')
+        for inst in insts:
+            out.write('    &&exec_%s,\n'%(inst['name'].upper()))
+        out.write('};\n')
+        out.write('#define EXASM_HANDLER(name) exec_##name\n')
+        out.write('#define EXASM_DISPATCH() goto *dispatch_table[static_cast<int>(inst.type)]\n')
+        out.write('#define EXASM_NEXT() \\\n')
+        out.write('    EXASM_FINISH_CYCLE(); \\\n')
+        out.write('    EXASM_BEGIN_CYCLE(); \\\n')
+        out.write('    EXASM_DISPATCH()\n')
+        out.write('EXASM_BEGIN_CYCLE();\n')
+        out.write('EXASM_DISPATCH();\n')
+        out.write('#else\n')
+        out.write('#define EXASM_HANDLER(name) case InstType::name\n')
+        out.write('#define EXASM_NEXT() \\\n')
+        out.write('    EXASM_FINISH_CYCLE(); \\\n')
+        out.write('    continue\n')
+        out.write('for (;;) {\n')
+        out.write('EXASM_BEGIN_CYCLE();\n')
+        out.write('switch (inst.type) {\n')
+        out.write('#endif\n')
+
+        for inst in insts:
+            out.write('EXASM_HANDLER(%s): {\n'%(inst['name'].upper()))
+            write_inst_body(out, inst)
+            out.write('    EXASM_NEXT();\n')
+            out.write('}\n')
+
+        out.write('#ifdef EXASM_THREADED_DISPATCH\n')
+        out.write('#pragma GCC diagnostic pop\n')
+        out.write('#undef EXASM_DISPATCH\n')
+        out.write('#else\n')
+        out.write('default:\n')
+        out.write('    return fail("Unsupported instruction");\n')
+        out.write('}\n')
+        out.write('}\n')
+        out.write('#endif\n')
+        out.write('#undef EXASM_HANDLER\n')
+        out.write('#undef EXASM_NEXT\n')
@@ -0,0 +1,48 @@
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+
+namespace exasm {
+    MappedFile::MappedFile(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED) {
+                    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+                    data = static_cast<const char *>(addr);
+                    size = st.st_size;
+                    mapped = true;
+                    is_open = true;
+                }
+            }
+            close(fd);
+        }
+        if (mapped) {
+            return;
+        }
+
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            return;
+        }
+        fallback.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data = fallback.data();
+        size = fallback.size();
+        is_open = true;
+    }
+
+    MappedFile::~MappedFile() {
+        if (mapped) {
+            munmap(const_cast<char *>(data), size);
+        }
+    }
+} // namespace exasm
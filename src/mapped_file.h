@@ -0,0 +1,33 @@
+#ifndef MAPPED_FILE_HH
+#define MAPPED_FILE_HH
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace exasm {
+    // Contents of a file mapped read-only into memory, so that AsmReader can
+    // read it in place. Falls back to reading the file when it can't be
+    // mapped, e.g. when it is empty or a pipe.
+    class MappedFile {
+    public:
+        explicit MappedFile(const char *path);
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+        ~MappedFile();
+
+        // False if the file could not be opened.
+        explicit operator bool() const { return is_open; }
+
+        std::string_view view() const { return {data, size}; }
+
+    private:
+        bool is_open = false;
+        bool mapped = false;
+        const char *data = nullptr;
+        std::size_t size = 0;
+        std::string fallback;
+    };
+} // namespace exasm
+
+#endif
@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "asmio.h"
+#include "insts.h"
+#include "pipeline.h"
+
+namespace exasm {
+#include "inst_traits.inc"
+
+    namespace {
+        constexpr std::uint64_t never = std::numeric_limits<std::uint64_t>::max();
+
+        // Cycle in which an instruction that leaves ID in cycle id is in stage.
+        std::uint64_t stage_cycle(std::uint64_t id, int stage) { return id + stage - 1; }
+    } // namespace
+
+    PipelineModel::PipelineModel(const PipelineConfig &config) : config(config) {
+        if (config.n_stages < PipelineConfig::min_stages ||
+            config.n_stages > PipelineConfig::max_stages) {
+            throw std::invalid_argument("Unsupported number of pipeline stages");
+        }
+        exec_stage = 2;
+        mem_stage = std::max(exec_stage, config.n_stages - 2);
+        alu_stage = std::max(exec_stage, config.n_stages - 3);
+        if (config.branch_stage < 1 || config.branch_stage > alu_stage) {
+            throw std::invalid_argument("Branches must resolve between ID and execute");
+        }
+
+        operands.resize(n_inst_types);
+        for (std::size_t i = 0; i < n_inst_types; ++i) {
+            InstType type = static_cast<InstType>(i);
+            Operands &ops = operands[i];
+            ops.reads_rd = inst_reads_rd(type);
+            ops.reads_rs = inst_reads_rs(type);
+            ops.writes_rd = inst_writes_rd(type);
+            ops.is_load = is_inst_load(type);
+            ops.is_branch = is_inst_branch(type);
+            // The stored value is only needed once memory is accessed.
+            ops.is_store = ops.reads_rd && ops.reads_rs && !ops.writes_rd && !ops.is_branch;
+        }
+    }
+
+    void PipelineModel::wait_for(std::uint8_t regnum, int need_stage, std::uint64_t &id,
+                                 StallReason &reason) const {
+        const RegState &reg = regs[regnum];
+        std::uint64_t earliest = reg.written_back;
+        if (reg.ready != never) {
+            std::uint64_t forwarded = reg.ready < static_cast<std::uint64_t>(need_stage)
+                                          ? 0
+                                          : reg.ready - need_stage + 1;
+            earliest = std::min(earliest, forwarded);
+        }
+        if (earliest > id) {
+            id = earliest;
+            reason = reg.loaded ? StallReason::LOAD_USE : StallReason::RAW;
+        }
+    }
+
+    void PipelineModel::issue(std::uint16_t addr, const DecodedInst &inst, bool taken,
+                              unsigned mem_stall) {
+        const Operands &ops = operands[static_cast<std::size_t>(inst.type)];
+
+        std::uint64_t fetch = next_fetch;
+        if (redirect_countdown > 0 && --redirect_countdown == 0 && redirect_fetch > fetch) {
+            std::uint64_t bubbles = redirect_fetch - fetch;
+            total_stalls[static_cast<std::size_t>(StallReason::BRANCH)] += bubbles;
+            stalls[redirect_from][static_cast<std::size_t>(StallReason::BRANCH)] += bubbles;
+            fetch = redirect_fetch;
+        }
+
+        // The instruction enters ID once the previous one has left it, and
+        // stays there until its operands can be had.
+        std::uint64_t enter_id = std::max(fetch + 1, last_id + 1);
+        std::uint64_t id = enter_id;
+        StallReason reason = StallReason::RAW;
+        if (ops.reads_rd) {
+            int need_stage = ops.is_branch  ? config.branch_stage
+                             : ops.is_store ? mem_stage
+                                            : exec_stage;
+            wait_for(inst.rd, need_stage, id, reason);
+        }
+        if (ops.reads_rs) {
+            wait_for(inst.rs, exec_stage, id, reason);
+        }
+        if (id > enter_id) {
+            total_stalls[static_cast<std::size_t>(reason)] += id - enter_id;
+            stalls[addr][static_cast<std::size_t>(reason)] += id - enter_id;
+        }
+
+        finish_issue(addr, ops, inst, taken, mem_stall, enter_id, id);
+    }
+
+    void PipelineModel::issue_unstalled(std::uint16_t addr, const DecodedInst &inst, bool taken) {
+        if (redirect_countdown > 0) {
+            --redirect_countdown;
+        }
+        std::uint64_t id = last_id + 1;
+        const Operands &ops = operands[static_cast<std::size_t>(inst.type)];
+        finish_issue(addr, ops, inst, taken, 0, id, id);
+    }
+
+    void PipelineModel::finish_issue(std::uint16_t addr, const Operands &ops,
+                                     const DecodedInst &inst, bool taken, unsigned mem_stall,
+                                     std::uint64_t enter_id, std::uint64_t id) {
+        // The memory stage and those after it start late by mem_stall.
+        std::uint64_t mem_done = stage_cycle(id, mem_stage) + mem_stall;
+        if (ops.writes_rd) {
+            RegState &reg = regs[inst.rd];
+            reg.loaded = ops.is_load;
+            if (ops.is_load) {
+                reg.ready = config.forward_mem ? mem_done + 1 : never;
+            } else if (config.forward_ex) {
+                reg.ready = stage_cycle(id, alu_stage) + 1;
+            } else {
+                reg.ready = config.forward_mem ? mem_done + 1 : never;
+            }
+            reg.written_back = stage_cycle(id, config.n_stages - 1) + mem_stall;
+        }
+        if (mem_stall != 0) {
+            total_stalls[static_cast<std::size_t>(StallReason::CACHE_MISS)] += mem_stall;
+            stalls[addr][static_cast<std::size_t>(StallReason::CACHE_MISS)] += mem_stall;
+        }
+
+        if (taken) {
+            // Skip the delay slot, which is fetched as usual.
+            redirect_countdown = 2;
+            redirect_fetch = stage_cycle(id, config.branch_stage) + 1;
+            redirect_from = addr;
+        }
+
+        next_fetch = enter_id + mem_stall;
+        last_id = id + mem_stall;
+        ++n_insts;
+    }
+
+    std::uint64_t PipelineModel::get_cycle_count() const {
+        if (n_insts == 0) {
+            return 0;
+        }
+        return stage_cycle(last_id, config.n_stages - 1) + 1;
+    }
+} // namespace exasm
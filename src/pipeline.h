@@ -0,0 +1,132 @@
+#ifndef PIPELINE_HH
+#define PIPELINE_HH
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "asmio.h"
+
+namespace exasm {
+    enum class StallReason {
+        // Waiting for an operand computed by an earlier instruction.
+        RAW,
+        // Waiting for an operand loaded by an earlier instruction.
+        LOAD_USE,
+        // Fetch bubble after a taken branch that resolves after the delay slot.
+        BRANCH,
+        // Memory stage held up by a data cache miss.
+        CACHE_MISS,
+    };
+
+    constexpr std::size_t n_stall_reasons = 4;
+
+    // Shape of the modeled in-order pipeline. Stage 0 fetches, stage 1
+    // decodes and reads registers, the last one writes back. The one before
+    // it accesses memory and the stages in between execute, so 5 stages are
+    // IF ID EX MEM WB. With 4 stages, memory is accessed in EX.
+    class PipelineConfig {
+    public:
+        static constexpr int min_stages = 4;
+        static constexpr int max_stages = 16;
+
+        int n_stages = 5;
+        // Results of the last execute stage go straight to the next
+        // instruction's execute stage.
+        bool forward_ex = true;
+        // Results and loaded values at the end of the memory stage go to the
+        // execute stage.
+        bool forward_mem = true;
+        // Stage in which branches compare their operand and redirect fetch.
+        // In ID, the delay slot hides the whole branch latency.
+        int branch_stage = 1;
+    };
+
+    // Timing of the executed instruction stream on a PipelineConfig. It is
+    // fed instructions in the order they complete and works out when each
+    // one could enter each stage.
+    class PipelineModel {
+    public:
+        // Throws std::invalid_argument if the stages do not fit together.
+        explicit PipelineModel(const PipelineConfig &config);
+
+        const PipelineConfig &get_config() const { return config; }
+
+        // mem_stall is how many extra cycles the instruction spends in the
+        // memory stage, which holds up all later instructions as well.
+        void issue(std::uint16_t addr, const DecodedInst &inst, bool taken,
+                   unsigned mem_stall = 0);
+
+        // Issues inst as if it waited for nothing, leaving ID the cycle after
+        // the previous instruction. Its results are then ready as late as
+        // they can be relative to later instructions.
+        void issue_unstalled(std::uint16_t addr, const DecodedInst &inst, bool taken);
+
+        // Cycles until the last instruction issued so far has written back.
+        std::uint64_t get_cycle_count() const;
+
+        std::uint64_t get_inst_count() const { return n_insts; }
+
+        std::uint64_t get_stall_count(StallReason reason) const {
+            return total_stalls[static_cast<std::size_t>(reason)];
+        }
+
+        // Stall cycles charged to the instruction at addr. Data stalls are
+        // charged to the instruction that waited, branch bubbles to the branch.
+        std::uint64_t get_stall_count(std::uint16_t addr, StallReason reason) const {
+            auto pos = stalls.find(addr);
+            return pos == stalls.end() ? 0 : pos->second[static_cast<std::size_t>(reason)];
+        }
+
+    private:
+        struct Operands {
+            bool reads_rd;
+            bool reads_rs;
+            bool writes_rd;
+            bool is_load;
+            bool is_branch;
+            bool is_store;
+        };
+
+        // A register value can be used in stage need_stage of a later
+        // instruction whose ID cycle is at least ready - need_stage + 1, or
+        // read from the register file in ID from cycle written_back.
+        struct RegState {
+            std::uint64_t ready = 0;
+            std::uint64_t written_back = 0;
+            bool loaded = false;
+        };
+
+        PipelineConfig config;
+        int exec_stage;
+        int alu_stage;
+        int mem_stage;
+        std::vector<Operands> operands;
+
+        std::array<RegState, 8> regs;
+        // Earliest cycle the next instruction can be fetched.
+        std::uint64_t next_fetch = 0;
+        // Cycle the previous instruction left ID, plus the cycles it held up
+        // the memory stage since all stages behind it were held up as well.
+        std::uint64_t last_id = 0;
+        // A taken branch redirects the fetch after its delay slot.
+        int redirect_countdown = 0;
+        std::uint64_t redirect_fetch = 0;
+        std::uint16_t redirect_from = 0;
+        std::uint64_t n_insts = 0;
+
+        std::array<std::uint64_t, n_stall_reasons> total_stalls{};
+        // Only instructions that stalled, so that a model is cheap to make.
+        std::unordered_map<std::uint16_t, std::array<std::uint64_t, n_stall_reasons>> stalls;
+
+        void wait_for(std::uint8_t regnum, int need_stage, std::uint64_t &id,
+                      StallReason &reason) const;
+        // Records the results of inst, which leaves ID in cycle id.
+        void finish_issue(std::uint16_t addr, const Operands &ops, const DecodedInst &inst,
+                          bool taken, unsigned mem_stall, std::uint64_t enter_id, std::uint64_t id);
+    };
+} // namespace exasm
+
+#endif
@@ -47,6 +47,38 @@ nop`
 
 let emulator = 0;
 
+// Must match exasm::RunStatus.
+const RunStatus = {
+    OK: 0,
+    BREAKPOINT: 1,
+    ERROR: 2,
+    CYCLE_LIMIT: 3,
+    HALT: 4,
+    WATCHPOINT: 5,
+};
+
+// Must match exasm::WatchKind, exasm::CondOperand and exasm::CondOp.
+const WatchKind = {
+    rwatch: 0,
+    watch: 1,
+    awatch: 2,
+};
+const CondOperand = {
+    REG: 0,
+    MEM: 1,
+};
+const CondOp = {
+    '==': 0,
+    '!=': 1,
+    '<': 2,
+    '<=': 3,
+    '>': 4,
+    '>=': 5,
+};
+
+// Cycles run per JS-to-wasm call while continuing.
+const continueSliceCycles = 1000000;
+
 const showError = (text) => {
     document.getElementById('err').innerText = text;
 };
@@ -80,13 +112,54 @@ const updateEmulatorStatus = () => {
         el.value = '0x' + Module.HEAPU8[memOffset + i].toString(16);
     }
 
+    showMemHeatmap();
+
     const clockCount = Module.ccall('get_estimated_clock', 'number', ['number'], [emulator]);
     document.getElementById('clock_count').innerText = clockCount;
+    ['stall_raw', 'stall_load_use', 'stall_branch', 'stall_cache_miss'].forEach((id, reason) => {
+        document.getElementById(id).innerText =
+            Module.ccall('get_pipeline_stall_count', 'number', ['number', 'number'],
+                         [emulator, reason]);
+    });
+    document.getElementById('cache_hits').innerText =
+        Module.ccall('get_cache_hit_count', 'number', ['number'], [emulator]);
+    document.getElementById('cache_misses').innerText =
+        Module.ccall('get_cache_miss_count', 'number', ['number'], [emulator]);
 };
 
 let memStart = 0;
 let memEnd = 0;
 
+// Views into the access counters in the wasm heap. They are recreated on every
+// update since growing the heap detaches the old buffer.
+const showMemHeatmap = () => {
+    const enabled = document.getElementById('mem_heatmap').checked;
+    const readsPtr = Module.ccall('get_mem_read_counts', 'number', ['number'], [emulator]);
+    const writesPtr = Module.ccall('get_mem_write_counts', 'number', ['number'], [emulator]);
+    if (!enabled || readsPtr === 0 || writesPtr === 0) {
+        for (let i = memStart; i < memEnd; ++i) {
+            const td = document.getElementById('mem' + i).parentNode;
+            td.style.backgroundColor = '';
+            td.title = '';
+        }
+        return;
+    }
+
+    const reads = new Uint32Array(Module.HEAPU8.buffer, readsPtr, 0x10000);
+    const writes = new Uint32Array(Module.HEAPU8.buffer, writesPtr, 0x10000);
+    let max = 1;
+    for (let i = memStart; i < memEnd; ++i) {
+        max = Math.max(max, reads[i], writes[i]);
+    }
+    const scale = n => Math.round(255 * Math.log1p(n) / Math.log1p(max));
+    for (let i = memStart; i < memEnd; ++i) {
+        const td = document.getElementById('mem' + i).parentNode;
+        // Writes in red, reads in blue.
+        td.style.backgroundColor = `rgba(${scale(writes[i])}, 0, ${scale(reads[i])}, 0.4)`;
+        td.title = `read ${reads[i]}, written ${writes[i]}`;
+    }
+};
+
 const createMemTable = () => {
     let start = parseInt(document.getElementById('mem_start').value);
     let end = parseInt(document.getElementById('mem_end').value);
@@ -252,7 +325,16 @@ const states = new Proxy(
                         const deleteButton = document.createElement('span');
                         deleteButton.innerText = 'delete_outline';
                         deleteButton.addEventListener('click', () => {
-                            if (typeof e.pc !== 'undefined') {
+                            if (typeof e.reg !== 'undefined') {
+                                states.breakpoints = states.breakpoints.filter(x => x !== e);
+                                Module.ccall('remove_reg_watchpoint', 'number', ['number', 'number'],
+                                             [emulator, e.reg]);
+                            } else if (typeof e.watch !== 'undefined') {
+                                states.breakpoints = states.breakpoints.filter(x => x !== e);
+                                Module.ccall('remove_mem_watchpoint', 'number',
+                                             ['number', 'number', 'number'],
+                                             [emulator, e.addr, e.len]);
+                            } else if (typeof e.pc !== 'undefined') {
                                 const checkBox = document.getElementById('break' + e.pc);
                                 if (checkBox !== null){
                                     checkBox.click();
@@ -269,8 +351,15 @@ const states = new Proxy(
                         tr.appendChild(td);
 
                         const condition = document.createElement('span');
-                        if (typeof e.pc !== 'undefined') {
-                            condition.innerText = `Fetch 0x${e.pc.toString(16)}`;
+                        if (typeof e.reg !== 'undefined') {
+                            condition.innerText = `Write r${e.reg}`;
+                        } else if (typeof e.watch !== 'undefined') {
+                            const kind = {rwatch: 'Read', watch: 'Write', awatch: 'Access'}[e.watch];
+                            condition.innerText = `${kind} 0x${e.addr.toString(16)}` +
+                                (e.len > 1 ? `-0x${(e.addr + e.len - 1).toString(16)}` : '');
+                        } else if (typeof e.pc !== 'undefined') {
+                            condition.innerText = `Fetch 0x${e.pc.toString(16)}` +
+                                (typeof e.cond !== 'undefined' ? ` if ${e.cond}` : '');
                         }
                         td.appendChild(condition);
 
@@ -288,16 +377,7 @@ const states = new Proxy(
     }
 );
 
-const clock = () => {
-    if (emulator === 0) {
-        showError('Program not loaded');
-        return;
-    }
-
-    showError('');
-
-    const addr = Module.ccall('next_clock', 'number', ['number'], [emulator]);
-
+const showExecutedState = (addr) => {
     createTraceTable();
 
     const breakAddr = Module.ccall('get_hit_breakpoint', 'number', ['number'], [emulator]);
@@ -313,6 +393,80 @@ const clock = () => {
     updateEmulatorStatus();
 };
 
+// Accepts "break ADDR [if rN|[ADDR] OP VALUE]", "watch rN" and
+// "watch|rwatch|awatch ADDR[-END]".
+const addBreakpointFromCommand = (command) => {
+    if (emulator === 0) {
+        showError('Program not loaded');
+        return;
+    }
+
+    command = command.trim();
+    let m;
+    if ((m = command.match(/^watch\s+r([0-7])$/))) {
+        const reg = parseInt(m[1]);
+        Module.ccall('set_reg_watchpoint', 'number', ['number', 'number'], [emulator, reg]);
+        states.breakpoints = states.breakpoints.concat({reg: reg});
+    } else if ((m = command.match(/^(watch|rwatch|awatch)\s+([0-9a-fA-Fx]+)(?:\s*-\s*([0-9a-fA-Fx]+))?$/))) {
+        const addr = parseInt(m[2]);
+        const last = typeof m[3] !== 'undefined' ? parseInt(m[3]) : addr;
+        if (isNaN(addr) || isNaN(last) || last < addr || last > 0xFFFF) {
+            showError('Invalid address range');
+            return;
+        }
+        Module.ccall('set_mem_watchpoint', 'number', ['number', 'number', 'number', 'number'],
+                     [emulator, addr, last - addr + 1, WatchKind[m[1]]]);
+        states.breakpoints = states.breakpoints.concat({watch: m[1], addr: addr, len: last - addr + 1});
+    } else if ((m = command.match(/^break\s+([0-9a-fA-Fx]+)(?:\s+if\s+(r[0-7]|\[[0-9a-fA-Fx]+\])\s*(==|!=|<=|>=|<|>)\s*(\S+))?$/))) {
+        const addr = parseInt(m[1]);
+        if (isNaN(addr) || addr > 0xFFFF) {
+            showError('Invalid address');
+            return;
+        }
+        const entry = {pc: addr};
+        if (typeof m[2] === 'undefined') {
+            Module.ccall('set_breakpoint', 'number', ['number', 'number'], [emulator, addr]);
+        } else {
+            const isReg = m[2][0] === 'r';
+            const index = isReg ? parseInt(m[2].substring(1)) : parseInt(m[2].slice(1, -1));
+            const value = parseInt(m[4]);
+            if (isNaN(index) || isNaN(value)) {
+                showError('Invalid condition');
+                return;
+            }
+            Module.ccall('set_conditional_breakpoint', 'number',
+                         ['number', 'number', 'number', 'number', 'number', 'number'],
+                         [emulator, addr, isReg ? CondOperand.REG : CondOperand.MEM, index,
+                          CondOp[m[3]], value & 0xFFFF]);
+            entry.cond = `${m[2]} ${m[3]} ${m[4]}`;
+        }
+        states.breakpoints = states.breakpoints
+            .filter(e => typeof e.pc === 'undefined' || e.pc !== addr)
+            .concat(entry);
+        const checkBox = document.getElementById('break' + addr);
+        if (checkBox !== null) {
+            checkBox.checked = true;
+        }
+    } else {
+        showError('Unknown breakpoint command: ' + command);
+        return;
+    }
+    showError('');
+};
+
+const clock = () => {
+    if (emulator === 0) {
+        showError('Program not loaded');
+        return;
+    }
+
+    showError('');
+
+    const addr = Module.ccall('next_clock', 'number', ['number'], [emulator]);
+
+    showExecutedState(addr);
+};
+
 const reverseClock = () => {
     if (emulator === 0) {
         showError('Program not loaded');
@@ -327,28 +481,86 @@ const reverseClock = () => {
     createTraceTable();
 
     if (addr < 0) {
-        clearBlinkLine();
+        showError('No more execution history to reverse');
     } else {
         blinkCurrentLine(addr);
     }
     updateEmulatorStatus();
 };
 
-const doContinue = () => {
+const reverseContinue = () => {
     if (emulator === 0) {
         showError('Program not loaded');
         return;
     }
 
-    for (let i = 0; i < 10; i++) {
-        clock();
-        if (states.breaked) {
-            states.continueInterrupted = true;
-            return;
-        } else if (states.continueInterrupted) {
+    showError('');
+
+    const addr = Module.ccall('reverse_continue', 'number', ['number'], [emulator]);
+    if (addr < 0) {
+        showError('No earlier breakpoint hit');
+        return;
+    }
+
+    showExecutedState(addr);
+};
+
+const reverseToLastWrite = () => {
+    if (emulator === 0) {
+        showError('Program not loaded');
+        return;
+    }
+
+    showError('');
+
+    const target = document.getElementById('last_write_target').value.trim();
+    let kind = 1;
+    let index;
+    if (/^r[0-7]$/.test(target)) {
+        kind = 0;
+        index = Number.parseInt(target.substring(1));
+    } else {
+        index = Number.parseInt(target);
+        if (isNaN(index) || index < 0 || index > 0xffff) {
+            showError('Register (r0-r7) or memory address expected');
             return;
         }
     }
+
+    const addr = Module.ccall('reverse_to_last_write', 'number', ['number', 'number', 'number'],
+                              [emulator, kind, index]);
+    if (addr === -2) {
+        showError('Last changed from outside the program');
+        return;
+    } else if (addr < 0) {
+        showError('No write found in the execution history');
+        return;
+    }
+
+    showExecutedState(addr);
+};
+
+const doContinue = () => {
+    if (emulator === 0) {
+        showError('Program not loaded');
+        return;
+    }
+
+    showError('');
+
+    const status = Module.ccall('run_clocks', 'number', ['number', 'number'],
+                                [emulator, continueSliceCycles]);
+    const addr = Module.ccall('get_next_pc', 'number', ['number'], [emulator]);
+
+    showExecutedState(addr);
+
+    if (states.breaked || status === RunStatus.ERROR || status === RunStatus.HALT ||
+        status === RunStatus.WATCHPOINT) {
+        states.continueInterrupted = true;
+        return;
+    } else if (states.continueInterrupted) {
+        return;
+    }
     setTimeout(doContinue);
 };
 
@@ -457,12 +669,33 @@ addEventListener('load', () => {
                 Module._free(memdata[0]);
                 Module._free(progdata[0]);
 
+                Module.ccall('set_enable_mem_access_counts', 'number', ['number', 'boolean'],
+                             [emulator, document.getElementById('mem_heatmap').checked]);
+                Module.ccall('set_enable_cache_model', 'number', ['number', 'boolean'],
+                             [emulator, document.getElementById('data_cache').checked]);
+
                 createTraceTable();
                 blinkCurrentLine(0);
 
                 updateEmulatorStatus();
             });
         });
+    document.getElementById('mem_heatmap')
+        .addEventListener('change', e => {
+            if (emulator !== 0) {
+                Module.ccall('set_enable_mem_access_counts', 'number', ['number', 'boolean'],
+                             [emulator, e.target.checked]);
+                showMemHeatmap();
+            }
+        });
+    document.getElementById('data_cache')
+        .addEventListener('change', e => {
+            if (emulator !== 0) {
+                Module.ccall('set_enable_cache_model', 'number', ['number', 'boolean'],
+                             [emulator, e.target.checked]);
+                updateEmulatorStatus();
+            }
+        });
     document.getElementById('set_range')
         .addEventListener('click', () => {
             createMemTable();
@@ -518,6 +751,20 @@ addEventListener('load', () => {
             traceOffset = 0;
             reverseClock();
         });
+    document.getElementById('reverse_continue')
+        .addEventListener('click', () => {
+            states.continueInterrupted = true;
+            states.breaked = false;
+            traceOffset = 0;
+            reverseContinue();
+        });
+    document.getElementById('reverse_to_last_write')
+        .addEventListener('click', () => {
+            states.continueInterrupted = true;
+            states.breaked = false;
+            traceOffset = 0;
+            reverseToLastWrite();
+        });
     document.getElementById('continue')
         .addEventListener('click', e => {
             states.breaked = false;
@@ -615,6 +862,12 @@ addEventListener('load', () => {
             updateEmulatorStatus();
         });
 
+    document.getElementById('add_breakpoint')
+        .addEventListener('click', () => {
+            const input = document.getElementById('breakpoint_command');
+            addBreakpointFromCommand(input.value);
+        });
+
     document.getElementById('close_notification')
         .addEventListener('click', e => {
             e.target.parentNode.animate([{opacity: 1}, {opacity: 0}], 300)
@@ -1,8 +1,12 @@
 #include <algorithm>
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <exception>
+#include <optional>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
 
 #include "asmio.h"
 #include "emulator.h"
@@ -10,14 +14,29 @@
 namespace {
     struct EmulatorWrapper {
         std::vector<exasm::Inst> prog;
+        exasm::DebugInfo debug_info;
         exasm::Emulator *emu;
         std::uint16_t next_pc;
         bool breakpoint_hit = false;
         std::uint16_t break_addr;
+        // Flat copy of the paged memory for JS to read through HEAPU8.
+        std::array<std::uint8_t, 0x10000> mem_view;
 
         EmulatorWrapper(exasm::Emulator *emu) : emu(emu) {}
         ~EmulatorWrapper() { delete emu; }
     };
+
+    // Ends a disassembled line with the symbol and source line of addr.
+    void write_debug_comment(std::ostream &out, const exasm::DebugInfo &debug_info,
+                             std::uint16_t addr) {
+        if (debug_info.find_symbol(addr) != nullptr) {
+            debug_info.write_symbol(out << " <", addr) << '>';
+        }
+        std::uint32_t line = debug_info.find_line(addr);
+        if (line != 0) {
+            out << " line " << line;
+        }
+    }
 } // namespace
 
 extern "C" {
@@ -29,7 +48,8 @@ __attribute__((used)) std::uint16_t get_register_value(EmulatorWrapper *ew, int
 }
 
 __attribute__((used)) const std::uint8_t *get_memory(EmulatorWrapper *ew) {
-    return ew->emu->get_memory().data();
+    ew->emu->get_memory().copy_to(ew->mem_view.data());
+    return ew->mem_view.data();
 }
 
 __attribute__((used)) std::uint16_t next_clock(EmulatorWrapper *ew) {
@@ -55,6 +75,35 @@ __attribute__((used)) std::uint16_t next_clock(EmulatorWrapper *ew) {
     return 0;
 }
 
+__attribute__((used)) int run_clocks(EmulatorWrapper *ew, std::uint32_t max_cycles) {
+    exasm::RunStatus status = exasm::RunStatus::CYCLE_LIMIT;
+    if (ew->breakpoint_hit && max_cycles > 0) {
+        ew->breakpoint_hit = false;
+        ew->emu->set_enable_trap(false);
+        status = ew->emu->run(1);
+        ew->emu->set_enable_trap(true);
+        --max_cycles;
+    }
+    if (status == exasm::RunStatus::CYCLE_LIMIT) {
+        status = ew->emu->run(max_cycles);
+    }
+    ew->next_pc = ew->emu->get_next_pc();
+
+    if (status == exasm::RunStatus::ERROR) {
+        std::cerr << ew->emu->get_last_error() << '\n';
+    } else if (status == exasm::RunStatus::BREAKPOINT) {
+        std::cerr << "Breakpoint hit\n";
+        ew->breakpoint_hit = true;
+        ew->break_addr = ew->emu->get_stop_addr();
+    } else if (status == exasm::RunStatus::WATCHPOINT) {
+        std::cerr << "Watchpoint hit by instruction at 0x" << std::hex
+                  << ew->emu->get_stop_addr() << std::dec << '\n';
+    }
+    return static_cast<int>(status);
+}
+
+__attribute__((used)) std::uint16_t get_next_pc(EmulatorWrapper *ew) { return ew->next_pc; }
+
 __attribute__((used)) void set_register_value(EmulatorWrapper *ew, int number, std::uint16_t val) {
     if (number < 0 || 7 < number) {
         return;
@@ -93,7 +142,7 @@ __attribute__((used)) char *dump_partial_program(EmulatorWrapper *ew, int offset
                 begin_addr -= 2;
             }
         }
-        const std::array<std::uint8_t, 0x10000> &mem = ew->emu->get_memory();
+        const exasm::PagedMemory &mem = ew->emu->get_memory();
         for (int i = begin_addr; i < end_addr; i += 2) {
             std::uint16_t bin = (mem[i] << 8) | mem[i + 1];
             exasm::Inst inst = exasm::Inst::decode(bin);
@@ -101,6 +150,7 @@ __attribute__((used)) char *dump_partial_program(EmulatorWrapper *ew, int offset
             inst.print_bin(ostrm);
             ostrm << " // ";
             inst.print_asm(ostrm);
+            write_debug_comment(ostrm, ew->debug_info, i);
             ostrm << '\n';
         }
     } catch (exasm::ParseError &e) {
@@ -139,10 +189,42 @@ __attribute__((used)) void set_breakpoint(EmulatorWrapper *ew, std::uint16_t add
     ew->emu->set_breakpoint(addr);
 }
 
+__attribute__((used)) void set_conditional_breakpoint(EmulatorWrapper *ew, std::uint16_t addr,
+                                                      int operand, std::uint16_t index, int op,
+                                                      std::uint16_t value) {
+    exasm::BreakCondition cond{static_cast<exasm::CondOperand>(operand), index,
+                               static_cast<exasm::CondOp>(op), value};
+    ew->emu->set_breakpoint(addr, cond);
+}
+
 __attribute__((used)) void remove_breakpoint(EmulatorWrapper *ew, std::uint16_t addr) {
     ew->emu->remove_breakpoint(addr);
 }
 
+__attribute__((used)) void set_mem_watchpoint(EmulatorWrapper *ew, std::uint16_t addr,
+                                              std::uint16_t len, int kind) {
+    ew->emu->set_mem_watchpoint(addr, len, static_cast<exasm::WatchKind>(kind));
+}
+
+__attribute__((used)) void remove_mem_watchpoint(EmulatorWrapper *ew, std::uint16_t addr,
+                                                 std::uint16_t len) {
+    ew->emu->remove_mem_watchpoint(addr, len);
+}
+
+__attribute__((used)) void set_reg_watchpoint(EmulatorWrapper *ew, int number) {
+    if (number < 0 || 7 < number) {
+        return;
+    }
+    ew->emu->set_reg_watchpoint(number);
+}
+
+__attribute__((used)) void remove_reg_watchpoint(EmulatorWrapper *ew, int number) {
+    if (number < 0 || 7 < number) {
+        return;
+    }
+    ew->emu->remove_reg_watchpoint(number);
+}
+
     __attribute__((used)) int get_hit_breakpoint(EmulatorWrapper *ew) {
     if (ew->breakpoint_hit) {
         return static_cast<std::uint32_t>(ew->break_addr);
@@ -160,10 +242,163 @@ __attribute__((used)) int reverse_next_clock(EmulatorWrapper *ew) {
     }
 }
 
+__attribute__((used)) int reverse_continue(EmulatorWrapper *ew) {
+    if (!ew->emu->reverse_continue()) {
+        return -1;
+    }
+    ew->next_pc = ew->emu->get_next_pc();
+    // Stopped at the breakpoint, so the next continue has to step over it.
+    ew->breakpoint_hit = true;
+    ew->break_addr = ew->next_pc;
+    return static_cast<std::uint32_t>(ew->next_pc);
+}
+
+__attribute__((used)) int seek_to_clock(EmulatorWrapper *ew, std::uint32_t clock) {
+    try {
+        if (ew->emu->seek_to_clock(clock) == exasm::RunStatus::ERROR) {
+            std::cerr << ew->emu->get_last_error() << '\n';
+        }
+    } catch (const exasm::HistoryExhausted &e) {
+        return -1;
+    }
+    ew->next_pc = ew->emu->get_next_pc();
+    ew->breakpoint_hit = false;
+    return static_cast<std::uint32_t>(ew->next_pc);
+}
+
+// Where a register (kind 0, index is its number) or a memory byte (kind 1,
+// index is its address) last got its value. Returns the address of the
+// instruction that wrote it, -2 if it was set from outside and -1 if no
+// write is known.
+__attribute__((used)) int find_last_write(EmulatorWrapper *ew, int kind, int index) {
+    std::optional<exasm::WriteRecord> write =
+        kind == 0 ? ew->emu->find_last_reg_write(index & 0x7)
+                  : ew->emu->find_last_mem_write(static_cast<std::uint16_t>(index));
+    if (!write) {
+        return -1;
+    }
+    return write->external ? -2 : static_cast<int>(write->pc);
+}
+
+// Goes back to right before the instruction found by find_last_write and
+// returns its address, or what find_last_write returned without moving.
+__attribute__((used)) int reverse_to_last_write(EmulatorWrapper *ew, int kind, int index) {
+    std::optional<exasm::WriteRecord> write =
+        kind == 0 ? ew->emu->find_last_reg_write(index & 0x7)
+                  : ew->emu->find_last_mem_write(static_cast<std::uint16_t>(index));
+    if (!write) {
+        return -1;
+    } else if (write->external) {
+        return -2;
+    }
+    return seek_to_clock(ew, static_cast<std::uint32_t>(write->clock - 1));
+}
+
+__attribute__((used)) void set_enable_profile(EmulatorWrapper *ew, bool enable) {
+    ew->emu->set_enable_profile(enable);
+}
+
+// The profile counters are 64 bit. JS views them without copying as
+// new BigUint64Array(Module.HEAPU8.buffer, ptr, length).
+__attribute__((used)) const std::uint64_t *get_profile_pc_counts(EmulatorWrapper *ew) {
+    const exasm::Profile *profile = ew->emu->get_profile();
+    return profile ? profile->pc_counts.data() : nullptr;
+}
+
+__attribute__((used)) const std::uint64_t *get_profile_branch_taken(EmulatorWrapper *ew) {
+    const exasm::Profile *profile = ew->emu->get_profile();
+    return profile ? profile->branch_taken.data() : nullptr;
+}
+
+__attribute__((used)) const std::uint64_t *get_profile_branch_not_taken(EmulatorWrapper *ew) {
+    const exasm::Profile *profile = ew->emu->get_profile();
+    return profile ? profile->branch_not_taken.data() : nullptr;
+}
+
+__attribute__((used)) const std::uint64_t *get_profile_inst_counts(EmulatorWrapper *ew) {
+    const exasm::Profile *profile = ew->emu->get_profile();
+    return profile ? profile->inst_counts.data() : nullptr;
+}
+
+__attribute__((used)) std::uint32_t get_profile_inst_type_count(EmulatorWrapper *ew) {
+    const exasm::Profile *profile = ew->emu->get_profile();
+    return profile ? profile->inst_counts.size() : 0;
+}
+
+__attribute__((used)) char *get_inst_type_name(std::uint32_t type) {
+    std::ostringstream strm;
+    strm << static_cast<exasm::InstType>(type);
+    const std::string &str = strm.str();
+    char *result = new char[str.size() + 1];
+    std::copy(str.begin(), str.end(), result);
+    result[str.size()] = '\0';
+    return result;
+}
+
+__attribute__((used)) void set_enable_mem_access_counts(EmulatorWrapper *ew, bool enable) {
+    ew->emu->set_enable_mem_access_counts(enable);
+}
+
+// 0x10000 counters each. JS views them without copying as
+// new Uint32Array(Module.HEAPU8.buffer, ptr, 0x10000).
+__attribute__((used)) const std::uint32_t *get_mem_read_counts(EmulatorWrapper *ew) {
+    const exasm::MemAccessCounts *counts = ew->emu->get_mem_access_counts();
+    return counts ? counts->reads.data() : nullptr;
+}
+
+__attribute__((used)) const std::uint32_t *get_mem_write_counts(EmulatorWrapper *ew) {
+    const exasm::MemAccessCounts *counts = ew->emu->get_mem_access_counts();
+    return counts ? counts->writes.data() : nullptr;
+}
+
+// Restarts the pipeline model with the given shape. Returns false and keeps
+// the current one if the shape is not supported.
+__attribute__((used)) bool set_pipeline_config(EmulatorWrapper *ew, int n_stages, bool forward_ex,
+                                               bool forward_mem, int branch_stage) {
+    exasm::PipelineConfig config;
+    config.n_stages = n_stages;
+    config.forward_ex = forward_ex;
+    config.forward_mem = forward_mem;
+    config.branch_stage = branch_stage;
+    try {
+        ew->emu->set_enable_pipeline_model(true, config);
+    } catch (const std::invalid_argument &e) {
+        std::cerr << e.what() << '\n';
+        return false;
+    }
+    return true;
+}
+
+// Total stall cycles for a StallReason.
+__attribute__((used)) std::uint32_t get_pipeline_stall_count(EmulatorWrapper *ew, int reason) {
+    const exasm::PipelineModel *pipeline = ew->emu->get_pipeline_model();
+    if (pipeline == nullptr) {
+        return 0;
+    }
+    return pipeline->get_stall_count(static_cast<exasm::StallReason>(reason));
+}
+
+__attribute__((used)) void set_enable_cache_model(EmulatorWrapper *ew, bool enable) {
+    ew->emu->set_enable_cache_model(enable);
+}
+
+__attribute__((used)) std::uint32_t get_cache_hit_count(EmulatorWrapper *ew) {
+    const exasm::CacheModel *cache = ew->emu->get_cache_model();
+    return cache ? cache->get_hit_count() : 0;
+}
+
+__attribute__((used)) std::uint32_t get_cache_miss_count(EmulatorWrapper *ew) {
+    const exasm::CacheModel *cache = ew->emu->get_cache_model();
+    return cache ? cache->get_miss_count() : 0;
+}
+
+__attribute__((used)) void set_exec_history_budget(EmulatorWrapper *ew, std::uint32_t bytes) {
+    ew->emu->set_exec_history_budget(bytes);
+}
+
 __attribute__((used)) EmulatorWrapper *init_emulator(char *memfile, std::size_t memfile_len,
                                                      char *prog, std::size_t prog_len) {
-    std::istringstream prog_strm(std::string(prog, prog + prog_len));
-    exasm::AsmReader reader(prog_strm);
+    exasm::AsmReader reader(std::string_view(prog, prog_len));
     exasm::RawAsm raw_asm;
     bool has_error = false;
     while (!reader.finished()) {
@@ -193,6 +428,8 @@ __attribute__((used)) EmulatorWrapper *init_emulator(char *memfile, std::size_t
 
     auto *emu = new exasm::Emulator;
     emu->set_enable_exec_history(true);
+    emu->set_enable_write_index(true);
+    emu->set_enable_pipeline_model(true);
 
     std::istringstream mem_strm(std::string(memfile, memfile + memfile_len));
     emu->load_memfile(mem_strm);
@@ -200,11 +437,22 @@ __attribute__((used)) EmulatorWrapper *init_emulator(char *memfile, std::size_t
 
     auto *ew = new EmulatorWrapper(emu);
     ew->prog = insts;
+    ew->debug_info = raw_asm.get_debug_info();
     ew->next_pc = 0;
 
     return ew;
 }
 
+__attribute__((used)) EmulatorWrapper *fork_emulator(EmulatorWrapper *ew) {
+    auto *fork = new EmulatorWrapper(new exasm::Emulator(ew->emu->fork()));
+    fork->prog = ew->prog;
+    fork->debug_info = ew->debug_info;
+    fork->next_pc = ew->next_pc;
+    fork->breakpoint_hit = ew->breakpoint_hit;
+    fork->break_addr = ew->break_addr;
+    return fork;
+}
+
 __attribute__((used)) void destroy_emulator(EmulatorWrapper *ew) {
     delete ew;
 }
@@ -212,8 +460,9 @@ __attribute__((used)) void destroy_emulator(EmulatorWrapper *ew) {
 __attribute__((used)) char *serialize_mem(EmulatorWrapper *ew) {
     std::ostringstream strm;
     strm << "{int i;static unsigned char t[]={";
-    for (std::uint8_t val : ew->emu->get_memory()) {
-        strm << +val << ',';
+    const exasm::PagedMemory &mem = ew->emu->get_memory();
+    for (int i = 0; i < 0x10000; ++i) {
+        strm << +mem[i] << ',';
     }
     strm << "};for(i=0;i<0x10000;++i)mem[i]=t[i];}\n";
 
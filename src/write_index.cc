@@ -0,0 +1,52 @@
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+
+#include "write_index.h"
+
+namespace exasm {
+    WriteIndex::WriteIndex(std::size_t max_writes)
+        : max_writes(std::max<std::size_t>(max_writes, 2)), by_location(n_locations) {}
+
+    void WriteIndex::record(std::uint32_t location, std::uint64_t clock, std::uint16_t pc,
+                            bool external) {
+        if (log.size() >= max_writes) {
+            drop_oldest();
+        }
+        by_location[location].push_back(static_cast<std::uint32_t>(log.size()));
+        log.push_back(Entry{clock, location, pc, external});
+    }
+
+    void WriteIndex::truncate(std::uint64_t clock) {
+        // The newest write to a location is always at the back of its list.
+        while (!log.empty() && log.back().clock > clock) {
+            by_location[log.back().location].pop_back();
+            log.pop_back();
+        }
+    }
+
+    std::optional<WriteRecord> WriteIndex::find_last_write(std::uint32_t location,
+                                                           std::uint64_t clock) const {
+        const std::vector<std::uint32_t> &writes = by_location[location];
+        auto pos = std::upper_bound(
+            writes.begin(), writes.end(), clock,
+            [this](std::uint64_t clock, std::uint32_t i) { return clock < log[i].clock; });
+        if (pos == writes.begin()) {
+            return std::nullopt;
+        }
+        const Entry &entry = log[*(pos - 1)];
+        return WriteRecord{entry.clock, entry.pc, entry.external};
+    }
+
+    void WriteIndex::drop_oldest() {
+        std::uint32_t cut = static_cast<std::uint32_t>(log.size() / 2);
+        log.erase(log.begin(), log.begin() + cut);
+        for (std::vector<std::uint32_t> &writes : by_location) {
+            auto keep = std::lower_bound(writes.begin(), writes.end(), cut);
+            writes.erase(writes.begin(), keep);
+            for (std::uint32_t &i : writes) {
+                i -= cut;
+            }
+        }
+    }
+} // namespace exasm
@@ -0,0 +1,65 @@
+#ifndef WRITE_INDEX_HH
+#define WRITE_INDEX_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace exasm {
+    // A write found in a WriteIndex.
+    class WriteRecord {
+    public:
+        // The written value is seen from the start of this cycle on, so an
+        // instruction that wrote ran in the cycle before.
+        std::uint64_t clock;
+        // Address of the instruction that wrote.
+        std::uint16_t pc;
+        // Made with set_memory() or set_register() instead of by an instruction.
+        bool external;
+    };
+
+    // Writes to each memory byte and register in the order they were seen,
+    // so that the last one before a cycle is found by binary search. The
+    // oldest half is dropped when it grows past its limit.
+    class WriteIndex {
+    public:
+        static constexpr std::size_t n_locations = 0x10000 + 8;
+        static constexpr std::size_t default_max_writes = 1 << 22;
+
+        static std::uint32_t mem_location(std::uint16_t addr) { return addr; }
+        static std::uint32_t reg_location(std::uint8_t regnum) { return 0x10000 + regnum; }
+
+        explicit WriteIndex(std::size_t max_writes = default_max_writes);
+
+        // clock must not be less than that of any write recorded before.
+        void record(std::uint32_t location, std::uint64_t clock, std::uint16_t pc, bool external);
+
+        // Forgets the writes seen only after clock, when going back in time.
+        void truncate(std::uint64_t clock);
+
+        // The last write to location seen at the start of cycle clock, or
+        // nullopt if there is none or it has been dropped.
+        std::optional<WriteRecord> find_last_write(std::uint32_t location,
+                                                   std::uint64_t clock) const;
+
+        std::size_t size() const { return log.size(); }
+
+    private:
+        struct Entry {
+            std::uint64_t clock;
+            std::uint32_t location;
+            std::uint16_t pc;
+            bool external;
+        };
+
+        std::size_t max_writes;
+        std::vector<Entry> log;
+        // Positions in log of the writes to each location.
+        std::vector<std::vector<std::uint32_t>> by_location;
+
+        void drop_oldest();
+    };
+} // namespace exasm
+
+#endif